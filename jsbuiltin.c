@@ -229,6 +229,77 @@ static void jsB_encodeURIComponent(js_State *J)
 	Encode(J, js_tostring(J, 1), URIUNESCAPED);
 }
 
+/*
+	RegExp, Date, the error types, Math and JSON are only created when a
+	script first looks up one of their global names, or when the runtime
+	needs one of their prototypes. The rest are needed for any script.
+*/
+
+static const struct { const char *name; int which; } jb_lazynames[] = {
+	{ "Date", JB_DATE },
+	{ "Error", JB_ERROR },
+	{ "EvalError", JB_ERROR },
+	{ "JSON", JB_JSON },
+	{ "Math", JB_MATH },
+	{ "RangeError", JB_ERROR },
+	{ "ReferenceError", JB_ERROR },
+	{ "RegExp", JB_REGEXP },
+	{ "SyntaxError", JB_ERROR },
+	{ "TypeError", JB_ERROR },
+	{ "URIError", JB_ERROR },
+};
+
+void jb_lazyinit(js_State *J, int which)
+{
+	which &= J->lazy;
+	/* clear first: creating a library defines its globals, which comes back here */
+	J->lazy &= ~which;
+
+	if (which & JB_REGEXP) {
+		J->RegExp_prototype = js_newobject(J, JS_COBJECT, J->Object_prototype);
+		jb_initregexp(J);
+	}
+	if (which & JB_DATE) {
+		J->Date_prototype = js_newobject(J, JS_CDATE, J->Object_prototype);
+		jb_initdate(J);
+	}
+	if (which & JB_ERROR) {
+		J->Error_prototype      = js_newobject(J, JS_CERROR, J->Object_prototype);
+		J->EvalError_prototype  = js_newobject(J, JS_CERROR, J->Error_prototype);
+		J->RangeError_prototype = js_newobject(J, JS_CERROR, J->Error_prototype);
+		J->ReferenceError_prototype = js_newobject(J, JS_CERROR, J->Error_prototype);
+		J->SyntaxError_prototype    = js_newobject(J, JS_CERROR, J->Error_prototype);
+		J->TypeError_prototype      = js_newobject(J, JS_CERROR, J->Error_prototype);
+		J->URIError_prototype       = js_newobject(J, JS_CERROR, J->Error_prototype);
+		jb_initerror(J);
+	}
+	if (which & JB_MATH)
+		jb_initmath(J);
+	if (which & JB_JSON)
+		jb_initjson(J);
+}
+
+void jb_lazyname(js_State *J, const char *name)
+{
+	int lo = 0, hi = nelem(jb_lazynames) - 1, mid, c;
+	/* every global variable lookup comes through here; most names start with other letters */
+	if (!strchr("DEJMRSTU", name[0]) || name[0] == 0)
+		return;
+	while (lo <= hi) {
+		mid = (lo + hi) >> 1;
+		c = strcmp(name, jb_lazynames[mid].name);
+		if (c < 0)
+			hi = mid - 1;
+		else if (c > 0)
+			lo = mid + 1;
+		else {
+			if (J->lazy & jb_lazynames[mid].which)
+				jb_lazyinit(J, jb_lazynames[mid].which);
+			return;
+		}
+	}
+}
+
 void jb_init(js_State *J)
 {
 	/* Create the prototype objects here, before the constructors */
@@ -238,17 +309,6 @@ void jb_init(js_State *J)
 	J->Boolean_prototype  = js_newobject(J, JS_CBOOLEAN, J->Object_prototype);
 	J->Number_prototype   = js_newobject(J, JS_CNUMBER, J->Object_prototype);
 	J->String_prototype   = js_newobject(J, JS_CSTRING, J->Object_prototype);
-	J->RegExp_prototype   = js_newobject(J, JS_COBJECT, J->Object_prototype);
-	J->Date_prototype     = js_newobject(J, JS_CDATE, J->Object_prototype);
-
-	/* All the native error types */
-	J->Error_prototype      = js_newobject(J, JS_CERROR, J->Object_prototype);
-	J->EvalError_prototype  = js_newobject(J, JS_CERROR, J->Error_prototype);
-	J->RangeError_prototype = js_newobject(J, JS_CERROR, J->Error_prototype);
-	J->ReferenceError_prototype = js_newobject(J, JS_CERROR, J->Error_prototype);
-	J->SyntaxError_prototype    = js_newobject(J, JS_CERROR, J->Error_prototype);
-	J->TypeError_prototype      = js_newobject(J, JS_CERROR, J->Error_prototype);
-	J->URIError_prototype       = js_newobject(J, JS_CERROR, J->Error_prototype);
 
 	/* Create the constructors and fill out the prototype objects */
 	jb_initobject(J);
@@ -257,11 +317,7 @@ void jb_init(js_State *J)
 	jb_initboolean(J);
 	jb_initnumber(J);
 	jb_initstring(J);
-	jb_initregexp(J);
-	jb_initdate(J);
-	jb_initerror(J);
-	jb_initmath(J);
-	jb_initjson(J);
+	J->lazy = JB_REGEXP | JB_DATE | JB_ERROR | JB_MATH | JB_JSON;
 
 	/* Initialize the global object */
 	js_push_number(J, NAN);
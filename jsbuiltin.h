@@ -14,6 +14,19 @@ void jb_initmath(js_State *J);
 void jb_initjson(js_State *J);
 void jb_initdate(js_State *J);
 
+/* Libraries created the first time their global names are looked up */
+enum {
+	JB_REGEXP = 1,
+	JB_DATE = 2,
+	JB_ERROR = 4,
+	JB_MATH = 8,
+	JB_JSON = 16,
+};
+
+void jb_lazyinit(js_State *J, int which);
+void jb_lazyname(js_State *J, const char *name);
+#define JB_NEED(J, which) if ((J)->lazy & (which)) jb_lazyinit(J, which)
+
 void jb_prop_func(js_State *J, const char *name, js_CFunction cfun, int n);
 void jb_prop_num(js_State *J, const char *name, double number);
 void jb_prop_str(js_State *J, const char *name, const char *string);
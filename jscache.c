@@ -0,0 +1,184 @@
+#include "jsi.h"
+#include "jsparse.h"
+#include "jscompile.h"
+
+/*
+	Compiled code cache. Scripts from js_loadstring and eval, and the
+	bodies given to the Function constructor, are looked up by their
+	text, file name and strictness before being parsed, so compiling
+	the same text again is a hash lookup. The entries sit in hash
+	buckets and on a circular list, most recently used first; when the
+	cache is full the least recently used one is dropped.
+
+	The functions are roots for the garbage collector while cached.
+	A compiled function is never changed, so every script or function
+	object made from the same text can share it.
+*/
+
+#define JS_CODEFUNCTION 1
+#define JS_CODEPARAMS 2
+#define JS_CODESTRICT 4
+
+static unsigned int jsQ_hash(unsigned int h, const char *s, int n)
+{
+	while (n-- > 0)
+		h = (h ^ *(const unsigned char *)s++) * 16777619;
+	return h;
+}
+
+static js_Function *jsQ_parse(js_State *J, const char *filename, const char *params, const char *source, int function)
+{
+	js_Function *F;
+	if (function)
+		F = jsC_compilefunction(J, jsP_parsefunction(J, filename, params, source));
+	else
+		F = jsC_compile(J, jsP_parse(J, filename, source));
+	jsP_freeparse(J);
+	return F;
+}
+
+/* take e off the recently used list */
+static void jsQ_unlist(js_State *J, js_CodeEntry *e)
+{
+	if (e->next == e) {
+		J->codelru = NULL;
+	} else {
+		e->prev->next = e->next;
+		e->next->prev = e->prev;
+		if (J->codelru == e)
+			J->codelru = e->next;
+	}
+}
+
+/* put e at the front of the recently used list */
+static void jsQ_touch(js_State *J, js_CodeEntry *e)
+{
+	js_CodeEntry *head = J->codelru;
+	if (!head) {
+		e->prev = e->next = e;
+	} else {
+		e->next = head;
+		e->prev = head->prev;
+		head->prev->next = e;
+		head->prev = e;
+	}
+	J->codelru = e;
+}
+
+/* drop the least recently used entry */
+static void jsQ_evict(js_State *J)
+{
+	js_CodeEntry *e = J->codelru->prev;
+	js_CodeEntry **p = &J->codetab[e->hash & (J->codecap - 1)];
+	while (*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+	jsQ_unlist(J, e);
+	--J->codecount;
+	js_free(J, e);
+}
+
+static void jsQ_grow(js_State *J)
+{
+	int i, cap = J->codecap ? J->codecap * 2 : 16;
+	js_CodeEntry **tab = js_malloc(J, cap * sizeof *tab);
+	js_CodeEntry *e, *next;
+	memset(tab, 0, cap * sizeof *tab);
+	for (i = 0; i < J->codecap; ++i) {
+		for (e = J->codetab[i]; e; e = next) {
+			next = e->hnext;
+			e->hnext = tab[e->hash & (cap - 1)];
+			tab[e->hash & (cap - 1)] = e;
+		}
+	}
+	js_free(J, J->codetab);
+	J->codetab = tab;
+	J->codecap = cap;
+}
+
+js_Function *jsQ_compile(js_State *J, const char *filename, const char *params, const char *source, int function)
+{
+	const char *part[3];
+	int i, n, len[3], size, flags;
+	unsigned int h;
+	js_CodeEntry *e;
+	js_Function *F;
+	char *p;
+
+	if (J->codemax <= 0)
+		return jsQ_parse(J, filename, params, source, function);
+
+	flags = 0;
+	if (function) flags |= JS_CODEFUNCTION;
+	if (params) flags |= JS_CODEPARAMS;
+	if (J->default_strict) flags |= JS_CODESTRICT;
+
+	part[0] = filename;
+	part[1] = params ? params : "";
+	part[2] = source;
+	h = 2166136261U ^ flags;
+	size = 0;
+	for (i = 0; i < 3; ++i) {
+		size_t k = strlen(part[i]) + 1;
+		if (k > JS_CODETEXT - (size_t)size)
+			return jsQ_parse(J, filename, params, source, function);
+		len[i] = (int)k;
+		size += len[i];
+		h = jsQ_hash(h, part[i], len[i]);
+	}
+
+	if (J->codecap > 0) {
+		for (e = J->codetab[h & (J->codecap - 1)]; e; e = e->hnext) {
+			if (e->hash != h || e->size != size || e->flags != flags)
+				continue;
+			for (i = n = 0; i < 3; n += len[i++])
+				if (memcmp(e->text + n, part[i], len[i]))
+					break;
+			if (i == 3) {
+				if (J->codelru != e) {
+					jsQ_unlist(J, e);
+					jsQ_touch(J, e);
+				}
+				return e->fun;
+			}
+		}
+	}
+
+	F = jsQ_parse(J, filename, params, source, function);
+
+	while (J->codecount >= J->codemax)
+		jsQ_evict(J);
+	if (J->codecount >= J->codecap)
+		jsQ_grow(J);
+	e = js_malloc(J, offsetof(js_CodeEntry, text) + size);
+	e->fun = F;
+	e->hash = h;
+	e->size = size;
+	e->flags = flags;
+	for (i = 0, p = e->text; i < 3; p += len[i++])
+		memcpy(p, part[i], len[i]);
+	e->hnext = J->codetab[h & (J->codecap - 1)];
+	J->codetab[h & (J->codecap - 1)] = e;
+	jsQ_touch(J, e);
+	++J->codecount;
+
+	return F;
+}
+
+void jsQ_free(js_State *J)
+{
+	while (J->codecount > 0)
+		jsQ_evict(J);
+	js_free(J, J->codetab);
+	J->codetab = NULL;
+	J->codecap = 0;
+}
+
+int js_setcodecache(js_State *J, int count)
+{
+	int old = J->codemax;
+	J->codemax = count > 0 ? count : 0;
+	while (J->codecount > J->codemax)
+		jsQ_evict(J);
+	return old;
+}
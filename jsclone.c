@@ -0,0 +1,326 @@
+#include "jsi.h"
+#include "jscompile.h"
+#include "jsvalue.h"
+#include "jsrun.h"
+#include "regexp.h"
+
+/*
+	Cloning a state. The template's functions and interned strings are
+	frozen and shared with the clone, so only the objects, environments
+	and strings reachable from its roots are copied.
+
+	The copy is a breadth-first walk. When a node is first reached, its
+	copy is allocated and the original's gcnext is pointed at it, with
+	gcmark set to JS_GCCOPIED to say so. The original list links and
+	marks are saved on the side and put back when the walk is done.
+*/
+
+#define JS_GCCOPIED 3 /* never a real mark: marks are 0, 1 or 2 */
+
+typedef struct
+{
+	void *node;
+	void *next;
+	int mark;
+} jsX_Saved;
+
+typedef struct
+{
+	jsX_Saved *obj, *env, *str;
+	int nobj, nenv, nstr;
+	int objcap, envcap, strcap;
+} jsX_Clone;
+
+/* a plain string, so js_clonestate can pass it on after freeing the clone */
+static JS_NORETURN void jsX_error(js_State *K, const char *message)
+{
+	js_push_literal(K, message);
+	js_throw(K);
+}
+
+static jsX_Saved *jsX_save(js_State *K, jsX_Saved **list, int *n, int *cap)
+{
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 256;
+		*list = js_realloc(K, *list, *cap * sizeof **list);
+	}
+	return &(*list)[(*n)++];
+}
+
+static js_String *jsX_string(js_State *K, jsX_Clone *c, js_String *str)
+{
+	js_String *copy;
+	jsX_Saved *saved;
+	if (str->gcmark == JS_GCCOPIED)
+		return str->gcnext;
+	copy = jv_memstring(K, str->p, strlen(str->p));
+	saved = jsX_save(K, &c->str, &c->nstr, &c->strcap);
+	saved->node = str;
+	saved->next = str->gcnext;
+	saved->mark = str->gcmark;
+	str->gcnext = copy;
+	str->gcmark = JS_GCCOPIED;
+	return copy;
+}
+
+static js_Object *jsX_object(js_State *K, jsX_Clone *c, js_Object *obj)
+{
+	js_Object *copy;
+	jsX_Saved *saved;
+	if (!obj)
+		return NULL;
+	if (obj->gcmark == JS_GCCOPIED)
+		return obj->gcnext;
+	/* an empty object until it is filled in, so a failed clone can be freed */
+	copy = js_newobject(K, JS_COBJECT, NULL);
+	saved = jsX_save(K, &c->obj, &c->nobj, &c->objcap);
+	saved->node = obj;
+	saved->next = obj->gcnext;
+	saved->mark = obj->gcmark;
+	obj->gcnext = copy;
+	obj->gcmark = JS_GCCOPIED;
+	return copy;
+}
+
+static js_Env *jsX_environment(js_State *K, jsX_Clone *c, js_Env *env)
+{
+	js_Env *copy;
+	jsX_Saved *saved;
+	if (!env)
+		return NULL;
+	if (env->gcmark == JS_GCCOPIED)
+		return env->gcnext;
+	copy = jsR_newenvironment(K, NULL, NULL);
+	saved = jsX_save(K, &c->env, &c->nenv, &c->envcap);
+	saved->node = env;
+	saved->next = env->gcnext;
+	saved->mark = env->gcmark;
+	env->gcnext = copy;
+	env->gcmark = JS_GCCOPIED;
+	return copy;
+}
+
+static void jsX_value(js_State *K, jsX_Clone *c, js_Value *dst, const js_Value *src)
+{
+	*dst = *src;
+	if (src->type == JS_TMEMSTR)
+		dst->u.memstr = jsX_string(K, c, src->u.memstr);
+	else if (src->type == JS_TOBJECT)
+		dst->u.object = jsX_object(K, c, src->u.object);
+}
+
+/* property names are interned, and so frozen along with the template's strings */
+static js_Property *jsX_property(js_State *K, jsX_Clone *c, js_Property *node, js_Property *sentinel)
+{
+	js_Property *copy;
+	if (!node->level)
+		return sentinel;
+	copy = js_poolalloc(K, sizeof *copy);
+	copy->name = node->name;
+	copy->level = node->level;
+	copy->atts = node->atts;
+	copy->left = copy->right = sentinel;
+	if (node->atts & JS_ACCESSOR) {
+		copy->u.acc.getter = jsX_object(K, c, node->u.acc.getter);
+		copy->u.acc.setter = jsX_object(K, c, node->u.acc.setter);
+	} else {
+		jsX_value(K, c, &copy->u.value, &node->u.value);
+	}
+	copy->left = jsX_property(K, c, node->left, sentinel);
+	copy->right = jsX_property(K, c, node->right, sentinel);
+	return copy;
+}
+
+static void jsX_fillobject(js_State *K, jsX_Clone *c, js_Object *copy, js_Object *obj)
+{
+	js_Iterator *node, **tail;
+	const char *error;
+	int opts;
+
+	copy->prototype = jsX_object(K, c, obj->prototype);
+	copy->properties = jsX_property(K, c, obj->properties, copy->properties);
+	copy->count = obj->count;
+
+	/* set the class last, so a failed clone never frees half a regexp or iterator */
+	switch (obj->type) {
+	case JS_CARRAY:
+		copy->u.a.length = obj->u.a.length;
+		if (obj->u.a.match) {
+			int size = js_blocksize(obj->u.a.match);
+			js_Match *match = js_malloc(K, size);
+			memcpy(match, obj->u.a.match, size);
+			jsX_value(K, c, &match->input, &obj->u.a.match->input);
+			copy->u.a.match = match;
+		}
+		break;
+	case JS_CFUNCTION:
+	case JS_CSCRIPT:
+		copy->u.f.function = obj->u.f.function;
+		copy->u.f.scope = jsX_environment(K, c, obj->u.f.scope);
+		break;
+	case JS_CREGEXP:
+		opts = 0;
+		if (obj->u.r.flags & JS_REGEXP_I) opts |= REG_ICASE;
+		if (obj->u.r.flags & JS_REGEXP_M) opts |= REG_NEWLINE;
+		copy->u.r.source = js_strdup(K, obj->u.r.source);
+		copy->u.r.prog = js_regcompx(js_countalloc, K, obj->u.r.source, opts, &error);
+		if (!copy->u.r.prog) {
+			js_free(K, copy->u.r.source);
+			jsX_error(K, "cannot compile regular expression");
+		}
+		copy->u.r.flags = obj->u.r.flags;
+		copy->u.r.last = obj->u.r.last;
+		break;
+	case JS_CITERATOR:
+		copy->u.iter.target = jsX_object(K, c, obj->u.iter.target);
+		copy->type = JS_CITERATOR;
+		tail = &copy->u.iter.head;
+		for (node = obj->u.iter.head; node; node = node->next) {
+			*tail = js_poolalloc(K, sizeof **tail);
+			(*tail)->name = node->name;
+			(*tail)->next = NULL;
+			tail = &(*tail)->next;
+		}
+		break;
+	case JS_CUSERDATA:
+		if (obj->u.user.finalize)
+			jsX_error(K, "cannot clone userdata with a finalizer");
+		copy->u.user = obj->u.user;
+		break;
+	default:
+		copy->u = obj->u;
+		break;
+	}
+
+	copy->type = obj->type;
+	copy->extensible = obj->extensible;
+}
+
+static void jsX_walk(js_State *K, jsX_Clone *c, js_State *J)
+{
+	js_Object **protos = &J->Object_prototype;
+	js_Object **kprotos = &K->Object_prototype;
+	js_Env *env;
+	int i, o, e;
+
+	for (i = 0; &protos[i] <= &J->URIError_prototype; ++i)
+		kprotos[i] = jsX_object(K, c, protos[i]);
+	K->R = jsX_object(K, c, J->R);
+	K->G = jsX_object(K, c, J->G);
+	K->E = jsX_environment(K, c, J->E);
+	K->GE = jsX_environment(K, c, J->GE);
+	for (i = 0; i < J->top; ++i)
+		jsX_value(K, c, &K->stack[i], &J->stack[i]);
+	K->top = J->top;
+
+	/* fill in the copies as they are reached; filling may reach more */
+	o = e = 0;
+	while (o < c->nobj || e < c->nenv) {
+		while (o < c->nobj) {
+			js_Object *obj = c->obj[o++].node;
+			jsX_fillobject(K, c, obj->gcnext, obj);
+		}
+		while (e < c->nenv) {
+			env = c->env[e++].node;
+			env->gcnext->variables = jsX_object(K, c, env->variables);
+			env->gcnext->outer = jsX_environment(K, c, env->outer);
+		}
+	}
+}
+
+static void jsX_restore(jsX_Clone *c)
+{
+	int i;
+	for (i = 0; i < c->nobj; ++i) {
+		js_Object *obj = c->obj[i].node;
+		obj->gcnext = c->obj[i].next;
+		obj->gcmark = c->obj[i].mark;
+	}
+	for (i = 0; i < c->nenv; ++i) {
+		js_Env *env = c->env[i].node;
+		env->gcnext = c->env[i].next;
+		env->gcmark = c->env[i].mark;
+	}
+	for (i = 0; i < c->nstr; ++i) {
+		js_String *str = c->str[i].node;
+		str->gcnext = c->str[i].next;
+		str->gcmark = c->str[i].mark;
+	}
+}
+
+void jsX_clone(js_State *K, js_State *J)
+{
+	jsX_Clone c;
+	int i;
+
+	K->shared = J->shared;
+	jsG_retain(K->shared);
+	for (i = 0; i < J->nmodules; ++i)
+		jsG_holdmodule(K, J->modules[i]);
+
+	memset(&c, 0, sizeof c);
+	if (js_try(K)) {
+		jsX_restore(&c);
+		js_free(K, c.obj);
+		js_free(K, c.env);
+		js_free(K, c.str);
+		js_throw(K);
+	}
+	jsX_walk(K, &c, J);
+	js_endtry(K);
+
+	jsX_restore(&c);
+	js_free(K, c.obj);
+	js_free(K, c.env);
+	js_free(K, c.str);
+
+	K->uctx = J->uctx;
+	K->report = J->report;
+	K->panic = J->panic;
+	K->finalize = J->finalize;
+	K->default_strict = J->default_strict;
+	K->lazycompile = J->lazycompile;
+	K->strict = J->strict;
+	K->nextref = J->nextref;
+	K->lazy = J->lazy;
+	K->gcpause = J->gcpause;
+	K->gcminheap = J->gcminheap;
+	K->gcnursery = J->gcnursery;
+	K->gcincremental = J->gcincremental;
+	K->gcstepsize = J->gcstepsize;
+	K->gcstepmul = J->gcstepmul;
+	K->gcgenerational = J->gcgenerational;
+	K->memlimit = J->memlimit;
+	K->codemax = J->codemax;
+	K->gcmajor = K->gclimit = (size_t)K->gcminheap * 1024;
+	if (K->gcgenerational)
+		K->gcmajor = 0; /* nothing is old yet; start with a major collection */
+}
+
+js_State *js_clonestate(js_State *J)
+{
+	char message[256];
+	js_State *K;
+
+	if (J->bot > 0 || J->envtop > 0)
+		js_error(J, "cannot clone a running state");
+
+	jsG_freeze(J);
+
+	K = js_newstatex(J->alloc, J->actx);
+	if (!K)
+		js_error(J, "out of memory");
+
+	if (js_try(K)) {
+		if (js_is_string(K, -1))
+			snprintf(message, sizeof message, "%s", js_tostring(K, -1));
+		else
+			snprintf(message, sizeof message, "cannot clone state");
+		js_freestate(K);
+		js_error(J, "%s", message);
+	}
+	jsX_clone(K, J);
+	js_endtry(K);
+
+	return K;
+}
@@ -0,0 +1,448 @@
+#include "jsi.h"
+#include "jscompile.h"
+#include "jsvalue.h"
+
+/*
+	Precompiled scripts. A compiled function tree is written in a fixed
+	little-endian layout so the file can be moved between hosts:
+
+	header:   "\033JSC" u32:version u32:opcodes string:filename function
+	function: string:name u32:flags u32:numparams u32:line
+	          u32:codelen pad(2) u16[codelen]
+	          u32:numlen pad(8) f64[numlen]
+	          u32:strlen string[strlen]
+	          u32:varlen string[varlen]
+	          u32:funlen function[funlen]
+	string:   u32:length bytes[length] 0
+
+	Arrays are aligned from the start of the image and strings are null
+	terminated, so js_loadimage can leave the code, numbers and strings in
+	the image and only allocate the tables of pointers into it. Many
+	processes that map the same file then share one copy of the bulk of it.
+
+	Loading does not trust the file: every table index, local slot and
+	jump target in the code is checked before the function can run.
+	Bump JS_CODEVERSION when the layout or the meaning of an opcode changes.
+*/
+
+#define JS_CODEMAGIC "\033JSC"
+#define JS_CODEVERSION 2
+#define JS_OPCOUNT (OP_LINE + 1)
+
+enum { K_SCRIPT = 1, K_LIGHTWEIGHT = 2, K_STRICT = 4, K_ARGUMENTS = 8 };
+
+static int jsK_bigendian(void)
+{
+	union { int i; char c; } u;
+	u.i = 1;
+	return !u.c;
+}
+
+/* Saving */
+
+typedef struct
+{
+	FILE *f;
+	unsigned int pos;
+} jsK_Writer;
+
+static void jsK_putbyte(jsK_Writer *w, int c)
+{
+	putc(c, w->f);
+	++w->pos;
+}
+
+static void jsK_align(jsK_Writer *w, unsigned int n)
+{
+	while (w->pos % n)
+		jsK_putbyte(w, 0);
+}
+
+static void jsK_putint(jsK_Writer *w, unsigned int v)
+{
+	jsK_putbyte(w, v & 0xff);
+	jsK_putbyte(w, (v >> 8) & 0xff);
+	jsK_putbyte(w, (v >> 16) & 0xff);
+	jsK_putbyte(w, (v >> 24) & 0xff);
+}
+
+static void jsK_putnumber(jsK_Writer *w, double v)
+{
+	unsigned char b[sizeof v];
+	int i, big = jsK_bigendian();
+	memcpy(b, &v, sizeof v);
+	for (i = 0; i < 8; ++i)
+		jsK_putbyte(w, b[big ? 7 - i : i]);
+}
+
+static void jsK_putstring(jsK_Writer *w, const char *s)
+{
+	unsigned int n = strlen(s);
+	jsK_putint(w, n);
+	fwrite(s, 1, n + 1, w->f);
+	w->pos += n + 1;
+}
+
+static void jsK_putfunction(jsK_Writer *w, js_Function *F)
+{
+	int i;
+
+	jsK_putstring(w, F->name);
+	jsK_putint(w, (F->script ? K_SCRIPT : 0) | (F->lightweight ? K_LIGHTWEIGHT : 0) |
+		(F->strict ? K_STRICT : 0) | (F->arguments ? K_ARGUMENTS : 0));
+	jsK_putint(w, F->numparams);
+	jsK_putint(w, F->line);
+
+	jsK_putint(w, F->codelen);
+	jsK_align(w, 2);
+	for (i = 0; i < F->codelen; ++i) {
+		jsK_putbyte(w, F->code[i] & 0xff);
+		jsK_putbyte(w, (F->code[i] >> 8) & 0xff);
+	}
+
+	jsK_putint(w, F->numlen);
+	jsK_align(w, 8);
+	for (i = 0; i < F->numlen; ++i)
+		jsK_putnumber(w, F->numtab[i]);
+
+	jsK_putint(w, F->strlen);
+	for (i = 0; i < F->strlen; ++i)
+		jsK_putstring(w, F->strtab[i]);
+
+	jsK_putint(w, F->varlen);
+	for (i = 0; i < F->varlen; ++i)
+		jsK_putstring(w, F->vartab[i]);
+
+	jsK_putint(w, F->funlen);
+	for (i = 0; i < F->funlen; ++i)
+		jsK_putfunction(w, F->funtab[i]);
+}
+
+void js_savecode(js_State *J, int idx, const char *filename)
+{
+	js_Object *obj = js_toobject(J, idx);
+	jsK_Writer w;
+
+	if (obj->type != JS_CSCRIPT)
+		js_error_type(J, "not a compiled script");
+	jsC_compiletree(J, obj->u.f.function);
+
+	w.pos = 0;
+	w.f = fopen(filename, "wb");
+	if (!w.f)
+		js_error(J, "cannot open file: '%s'", filename);
+
+	fwrite(JS_CODEMAGIC, 1, 4, w.f);
+	w.pos += 4;
+	jsK_putint(&w, JS_CODEVERSION);
+	jsK_putint(&w, JS_OPCOUNT);
+	jsK_putstring(&w, obj->u.f.function->filename);
+	jsK_putfunction(&w, obj->u.f.function);
+
+	if (ferror(w.f)) {
+		fclose(w.f);
+		js_error(J, "cannot write file: '%s'", filename);
+	}
+	if (fclose(w.f))
+		js_error(J, "cannot write file: '%s'", filename);
+}
+
+/* Loading */
+
+typedef struct
+{
+	const unsigned char *start, *p, *end;
+	const char *name; /* for error messages */
+	const char *filename;
+	int inplace; /* point into the image instead of copying out of it */
+	char *tmp;
+	int tmpcap;
+} jsK_Reader;
+
+static JS_NORETURN void jsK_error(js_State *J, jsK_Reader *r, const char *what)
+{
+	js_error(J, "invalid bytecode in '%s': %s", r->name, what);
+}
+
+static void jsK_skipalign(js_State *J, jsK_Reader *r, unsigned int n)
+{
+	while ((r->p - r->start) % n) {
+		if (r->p == r->end)
+			jsK_error(J, r, "truncated file");
+		++r->p;
+	}
+}
+
+static void jsK_need(js_State *J, jsK_Reader *r, unsigned int n, unsigned int size)
+{
+	if (n > (unsigned int)(r->end - r->p) / size)
+		jsK_error(J, r, "truncated file");
+}
+
+static unsigned int jsK_getint(js_State *J, jsK_Reader *r)
+{
+	const unsigned char *p = r->p;
+	jsK_need(J, r, 4, 1);
+	r->p += 4;
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+/* a count of items of at least size bytes each, which must fit in what is left */
+static int jsK_getcount(js_State *J, jsK_Reader *r, unsigned int size)
+{
+	unsigned int n = jsK_getint(J, r);
+	jsK_need(J, r, n, size);
+	return n;
+}
+
+static double jsK_getnumber(js_State *J, jsK_Reader *r)
+{
+	unsigned char b[8];
+	double v;
+	int i, big = jsK_bigendian();
+	jsK_need(J, r, 8, 1);
+	for (i = 0; i < 8; ++i)
+		b[big ? 7 - i : i] = r->p[i];
+	r->p += 8;
+	memcpy(&v, b, sizeof v);
+	return v;
+}
+
+static const char *jsK_getstring(js_State *J, jsK_Reader *r)
+{
+	const char *s;
+	int n = jsK_getcount(J, r, 1);
+	jsK_need(J, r, n + 1, 1);
+	s = (const char *)r->p;
+	if (s[n] != 0 || memchr(s, 0, n))
+		jsK_error(J, r, "bad string");
+	r->p += n + 1;
+	return r->inplace ? s : js_intern(J, s);
+}
+
+static void jsK_checkcode(js_State *J, jsK_Reader *r, js_Function *F)
+{
+	js_Instruction *code = F->code;
+	int n = F->codelen;
+	int pc, op, k, last = -1;
+	char *start;
+
+	/* mark where each instruction starts so jumps can be checked against them */
+	if (n > r->tmpcap) {
+		r->tmp = js_realloc(J, r->tmp, n);
+		r->tmpcap = n;
+	}
+	start = r->tmp;
+	memset(start, 0, n);
+
+	for (pc = 0; pc < n;) {
+		start[pc] = 1;
+		last = op = code[pc++];
+		if (op >= JS_OPCOUNT)
+			jsK_error(J, r, "unknown opcode");
+		switch (op) {
+		case OP_NEWREGEXP:
+			if (pc + 1 >= n || code[pc] >= F->strlen || code[pc+1] > (JS_REGEXP_G | JS_REGEXP_I | JS_REGEXP_M))
+				jsK_error(J, r, "bad regular expression operand");
+			pc += 2;
+			break;
+		case OP_NUMBER:
+			if (pc >= n || code[pc++] >= F->numlen)
+				jsK_error(J, r, "bad number operand");
+			break;
+		case OP_STRING:
+		case OP_INITVAR:
+		case OP_DEFVAR:
+		case OP_GETVAR:
+		case OP_HASVAR:
+		case OP_SETVAR:
+		case OP_DELVAR:
+		case OP_GETPROP_S:
+		case OP_SETPROP_S:
+		case OP_DELPROP_S:
+		case OP_CATCH:
+			if (pc >= n || code[pc++] >= F->strlen)
+				jsK_error(J, r, "bad string operand");
+			break;
+		case OP_CLOSURE:
+			if (pc >= n || code[pc++] >= F->funlen)
+				jsK_error(J, r, "bad function operand");
+			break;
+		case OP_INITLOCAL:
+		case OP_GETLOCAL:
+		case OP_SETLOCAL:
+		case OP_DELLOCAL:
+			if (!F->lightweight || pc >= n || code[pc] < 1 || code[pc] > F->varlen)
+				jsK_error(J, r, "bad local operand");
+			++pc;
+			break;
+		case OP_NUMBER_POS:
+		case OP_NUMBER_NEG:
+		case OP_CALL:
+		case OP_NEW:
+		case OP_LINE:
+		case OP_JUMP:
+		case OP_JTRUE:
+		case OP_JFALSE:
+		case OP_JCASE:
+		case OP_TRY:
+			if (pc++ >= n)
+				jsK_error(J, r, "missing operand");
+			break;
+		}
+	}
+
+	/* the last instruction must return, so the code cannot run off its end */
+	if (last != OP_RETURN)
+		jsK_error(J, r, "code does not end with a return");
+
+	for (pc = 0; pc < n;) {
+		op = code[pc++];
+		switch (op) {
+		case OP_JUMP:
+		case OP_JTRUE:
+		case OP_JFALSE:
+		case OP_JCASE:
+		case OP_TRY:
+			k = code[pc];
+			if (k >= n || !start[k])
+				jsK_error(J, r, "bad jump target");
+			break;
+		}
+		while (pc < n && !start[pc])
+			++pc;
+	}
+}
+
+static js_Function *jsK_getfunction(js_State *J, jsK_Reader *r, int depth)
+{
+	js_Function *F;
+	unsigned int flags, numparams;
+	int i, n;
+
+	if (depth > JS_ASTLIMIT)
+		jsK_error(J, r, "functions nested too deeply");
+
+	/* link it in first so the collector frees it if the load fails */
+	F = js_malloc(J, sizeof *F);
+	memset(F, 0, sizeof *F);
+	F->gcmark = JS_GCNEWMARK(J);
+	F->gcnext = J->gcfun;
+	J->gcfun = F;
+	F->image = r->inplace;
+
+	F->filename = r->filename;
+	F->name = jsK_getstring(J, r);
+	flags = jsK_getint(J, r);
+	F->script = !!(flags & K_SCRIPT);
+	F->lightweight = !!(flags & K_LIGHTWEIGHT);
+	F->strict = !!(flags & K_STRICT);
+	F->arguments = !!(flags & K_ARGUMENTS);
+	numparams = jsK_getint(J, r);
+	F->line = jsK_getint(J, r);
+
+	n = jsK_getint(J, r);
+	jsK_skipalign(J, r, 2);
+	jsK_need(J, r, n, 2);
+	if (r->inplace) {
+		F->code = (js_Instruction *)r->p;
+	} else {
+		F->code = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->code);
+		for (i = 0; i < n; ++i)
+			F->code[i] = r->p[i*2] | r->p[i*2+1] << 8;
+	}
+	r->p += n * 2;
+	F->codecap = F->codelen = n;
+
+	n = jsK_getint(J, r);
+	jsK_skipalign(J, r, 8);
+	jsK_need(J, r, n, 8);
+	if (r->inplace) {
+		F->numtab = (double *)r->p;
+		r->p += n * 8;
+		F->numcap = F->numlen = n;
+	} else {
+		F->numtab = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->numtab);
+		F->numcap = n;
+		while (F->numlen < n)
+			F->numtab[F->numlen++] = jsK_getnumber(J, r);
+	}
+
+	n = jsK_getcount(J, r, 4);
+	F->strtab = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->strtab);
+	F->strcap = n;
+	while (F->strlen < n)
+		F->strtab[F->strlen++] = jsK_getstring(J, r);
+
+	n = jsK_getcount(J, r, 4);
+	F->vartab = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->vartab);
+	F->varcap = n;
+	while (F->varlen < n)
+		F->vartab[F->varlen++] = jsK_getstring(J, r);
+	if (numparams > (unsigned int)n)
+		jsK_error(J, r, "more parameters than variables");
+	F->numparams = numparams;
+
+	n = jsK_getcount(J, r, 4);
+	F->funtab = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->funtab);
+	F->funcap = n;
+	while (F->funlen < n) {
+		F->funtab[F->funlen] = jsK_getfunction(J, r, depth + 1);
+		++F->funlen;
+	}
+
+	jsK_checkcode(J, r, F);
+
+	return F;
+}
+
+int jsK_iscode(const char *data, int size)
+{
+	return size >= 4 && !memcmp(data, JS_CODEMAGIC, 4);
+}
+
+static void jsK_load(js_State *J, const char *name, const char *data, int size, int inplace)
+{
+	jsK_Reader r;
+	js_Function *F;
+
+	memset(&r, 0, sizeof r);
+	r.start = r.p = (const unsigned char *)data;
+	r.end = r.p + size;
+	r.name = name;
+	/* the arrays are little-endian and aligned relative to the image */
+	r.inplace = inplace && !jsK_bigendian() && (size_t)data % 8 == 0;
+
+	if (js_try(J)) {
+		js_free(J, r.tmp);
+		js_throw(J);
+	}
+
+	if (!jsK_iscode(data, size))
+		jsK_error(J, &r, "not a compiled script");
+	r.p += 4;
+	if (jsK_getint(J, &r) != JS_CODEVERSION || jsK_getint(J, &r) != JS_OPCOUNT)
+		jsK_error(J, &r, "compiled by a different version");
+
+	r.filename = jsK_getstring(J, &r);
+	F = jsK_getfunction(J, &r, 0);
+	if (!F->script)
+		jsK_error(J, &r, "not a compiled script");
+	if (r.p != r.end)
+		jsK_error(J, &r, "trailing data");
+
+	js_new_script(J, F, J->GE);
+
+	js_endtry(J);
+	js_free(J, r.tmp);
+}
+
+void js_loadcode(js_State *J, const char *name, const char *data, int size)
+{
+	jsK_load(J, name, data, size, 0);
+}
+
+void js_loadimage(js_State *J, const char *name, const char *data, int size)
+{
+	jsK_load(J, name, data, size, 1);
+}
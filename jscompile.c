@@ -11,6 +11,7 @@
 JS_NORETURN void jc_error(js_State *J, js_Ast *node, const char *fmt, ...) JS_PRINTFLIKE(3,4);
 
 static void cfunbody(JF, js_Ast *name, js_Ast *params, js_Ast *body);
+static int listlength(js_Ast *list);
 static void cexp(JF, js_Ast *exp);
 static void cstmlist(JF, js_Ast *list);
 static void cstm(JF, js_Ast *stm);
@@ -51,14 +52,13 @@ static void checkfutureword(JF, js_Ast *exp)
 	}
 }
 
-static js_Function *newfun(js_State *J, js_Ast *name, js_Ast *params, js_Ast *body, int script, int default_strict)
+static js_Function *allocfun(js_State *J, js_Ast *name, js_Ast *params, js_Ast *body, int script, int default_strict)
 {
 	js_Function *F = js_malloc(J, sizeof *F);
 	memset(F, 0, sizeof *F);
-	F->gcmark = 0;
+	F->gcmark = JS_GCNEWMARK(J);
 	F->gcnext = J->gcfun;
 	J->gcfun = F;
-	++J->gccounter;
 
 	F->filename = js_intern(J, J->filename);
 	F->line = name ? name->line : params ? params->line : body ? body->line : 1;
@@ -66,11 +66,41 @@ static js_Function *newfun(js_State *J, js_Ast *name, js_Ast *params, js_Ast *bo
 	F->strict = default_strict;
 	F->name = name ? name->string : "";
 
-	cfunbody(J, F, name, params, body);
+	return F;
+}
 
+static js_Function *newfun(js_State *J, js_Ast *name, js_Ast *params, js_Ast *body, int script, int default_strict)
+{
+	js_Function *F = allocfun(J, name, params, body, script, default_strict);
+	cfunbody(J, F, name, params, body);
 	return F;
 }
 
+/* An inner function; if its body was skipped, only its header is made */
+static js_Function *innerfun(JF, js_Ast *fun)
+{
+	js_Function *L;
+	int n;
+
+	if (!fun->source)
+		return newfun(J, fun->a, fun->b, fun->c, 0, F->strict);
+
+	if (!J->lazysource) {
+		n = strlen(J->astsource);
+		J->lazysource = js_malloc(J, soffsetof(js_Source, text) + n + 1);
+		J->lazysource->refs = 0;
+		memcpy(J->lazysource->text, J->astsource, n + 1);
+	}
+
+	L = allocfun(J, fun->a, fun->b, fun->c, 0, F->strict);
+	L->numparams = listlength(fun->b);
+	L->lazy = J->lazysource;
+	L->lazystart = fun->source - J->astsource;
+	L->lazyline = fun->sourceline;
+	++L->lazy->refs;
+	return L;
+}
+
 /* Emit opcodes, constants and jumps */
 
 static void emitraw(JF, int value)
@@ -108,10 +138,12 @@ static int addfunction(JF, js_Function *value)
 	return F->funlen++;
 }
 
+/* Only the latest constants are searched, so huge data literals do not take quadratic time */
+
 static int addnumber(JF, double value)
 {
 	int i;
-	for (i = 0; i < F->numlen; ++i)
+	for (i = F->numlen - 1; i >= 0 && i >= F->numlen - JS_CONSTSCAN; --i)
 		if (F->numtab[i] == value)
 			return i;
 	if (F->numlen >= F->numcap) {
@@ -125,7 +157,7 @@ static int addnumber(JF, double value)
 static int addstring(JF, const char *value)
 {
 	int i;
-	for (i = 0; i < F->strlen; ++i)
+	for (i = F->strlen - 1; i >= 0 && i >= F->strlen - JS_CONSTSCAN; --i)
 		if (!strcmp(F->strtab[i], value))
 			return i;
 	if (F->strlen >= F->strcap) {
@@ -580,7 +612,7 @@ static void cexp(JF, js_Ast *exp)
 		break;
 
 	case EXP_FUN:
-		emitfunction(J, F, newfun(J, exp->a, exp->b, exp->c, 0, F->strict));
+		emitfunction(J, F, innerfun(J, F, exp));
 		break;
 
 	case EXP_IDENTIFIER:
@@ -729,7 +761,7 @@ static void cexp(JF, js_Ast *exp)
 
 static void addjump(JF, enum js_AstType type, js_Ast *target, int inst)
 {
-	js_JumpList *jump = js_malloc(J, sizeof *jump);
+	js_JumpList *jump = jsP_alloc(J, sizeof *jump);
 	jump->type = type;
 	jump->inst = inst;
 	jump->next = target->jumps;
@@ -1221,6 +1253,14 @@ static void cstmlist(JF, js_Ast *list)
 
 static void analyze(JF, js_Ast *node)
 {
+	/* walk lists in a loop, so long array and object literals do not overflow the stack */
+	if (node->type == AST_LIST) {
+		for (; node; node = node->b)
+			if (node->a)
+				analyze(J, F, node->a);
+		return;
+	}
+
 	if (isfun(node->type)) {
 		F->lightweight = 0;
 		return; /* don't scan inner functions */
@@ -1275,23 +1315,58 @@ static int cparams(JF, js_Ast *list, js_Ast *fname)
 	return shadow;
 }
 
-static void cvardecs(JF, js_Ast *node)
+/* Declarations of a streamed script, emitted when it has all been read */
+
+typedef struct
+{
+	const char *name;
+	int fun; /* index in funtab, or -1 for a variable */
+} js_Decl;
+
+typedef struct
 {
+	js_Decl *list;
+	int len, cap;
+} js_DeclList;
+
+static void adddecl(js_State *J, js_DeclList *D, const char *name, int fun)
+{
+	if (D->len >= D->cap) {
+		D->cap = D->cap ? D->cap * 2 : 16;
+		D->list = js_realloc(J, D->list, D->cap * sizeof *D->list);
+	}
+	D->list[D->len].name = name;
+	D->list[D->len].fun = fun;
+	++D->len;
+}
+
+/* Emit the variable declarations, or add them to D to emit later */
+static void cvardecs(JF, js_DeclList *D, js_Ast *node)
+{
+	if (node->type == AST_LIST) {
+		for (; node; node = node->b)
+			if (node->a)
+				cvardecs(J, F, D, node->a);
+		return;
+	}
+
 	if (isfun(node->type))
 		return; /* stop at inner functions */
 
 	if (node->type == EXP_VAR) {
 		checkfutureword(J, F, node->a);
-		if (F->lightweight)
+		if (D)
+			adddecl(J, D, node->a->string, -1);
+		else if (F->lightweight)
 			addlocal(J, F, node->a, 1);
 		else
 			emitstring(J, F, OP_DEFVAR, node->a->string);
 	}
 
-	if (node->a) cvardecs(J, F, node->a);
-	if (node->b) cvardecs(J, F, node->b);
-	if (node->c) cvardecs(J, F, node->c);
-	if (node->d) cvardecs(J, F, node->d);
+	if (node->a) cvardecs(J, F, D, node->a);
+	if (node->b) cvardecs(J, F, D, node->b);
+	if (node->c) cvardecs(J, F, D, node->c);
+	if (node->d) cvardecs(J, F, D, node->d);
 }
 
 static void cfundecs(JF, js_Ast *list)
@@ -1299,7 +1374,7 @@ static void cfundecs(JF, js_Ast *list)
 	while (list) {
 		js_Ast *stm = list->a;
 		if (stm->type == AST_FUNDEC) {
-			emitfunction(J, F, newfun(J, stm->a, stm->b, stm->c, 0, F->strict));
+			emitfunction(J, F, innerfun(J, F, stm));
 			emitstring(J, F, OP_INITVAR, stm->a->string);
 		}
 		list = list->b;
@@ -1339,7 +1414,7 @@ static void cfunbody(JF, js_Ast *name, js_Ast *params, js_Ast *body)
 	}
 
 	if (body) {
-		cvardecs(J, F, body);
+		cvardecs(J, F, NULL, body);
 		cfundecs(J, F, body);
 	}
 
@@ -1356,10 +1431,136 @@ static void cfunbody(JF, js_Ast *name, js_Ast *params, js_Ast *body)
 
 js_Function *jsC_compilefunction(js_State *J, js_Ast *prog)
 {
+	J->lazysource = NULL;
 	return newfun(J, prog->a, prog->b, prog->c, 0, J->default_strict);
 }
 
 js_Function *jsC_compile(js_State *J, js_Ast *prog)
 {
+	J->lazysource = NULL;
 	return newfun(J, NULL, NULL, prog, 1, J->default_strict);
 }
+
+/*
+	Compile a script as it is parsed, one element at a time. Its
+	declarations must run first but are only all known at the end, so
+	the code begins with a jump to them there, and they jump back:
+
+		JUMP decls; body: UNDEF statements JUMP done;
+		decls: DEFVAR... CLOSURE INITVAR... JUMP body; done: RETURN
+*/
+js_Function *jsC_compilestream(js_State *J)
+{
+	js_DeclList D = { NULL, 0, 0 };
+	js_Function *F;
+	js_Ast *stm;
+	int decls, body, done, first, i;
+
+	J->lazysource = NULL;
+	F = allocfun(J, NULL, NULL, NULL, 1, J->default_strict);
+
+	if (js_try(J)) {
+		js_free(J, D.list);
+		js_throw(J);
+	}
+
+	decls = emitjump(J, F, OP_JUMP);
+	body = here(J, F);
+	emit(J, F, OP_UNDEF);
+
+	for (first = 1; (stm = jsP_parsenext(J)); first = 0) {
+		analyze(J, F, stm);
+		if (first && stm->type == EXP_STRING && !strcmp(stm->string, "use strict"))
+			F->strict = 1;
+		cvardecs(J, F, &D, stm);
+		if (stm->type == AST_FUNDEC)
+			adddecl(J, &D, stm->a->string, addfunction(J, F, innerfun(J, F, stm)));
+		cstm(J, F, stm);
+	}
+
+	done = emitjump(J, F, OP_JUMP);
+	label(J, F, decls);
+	for (i = 0; i < D.len; ++i)
+		if (D.list[i].fun < 0)
+			emitstring(J, F, OP_DEFVAR, D.list[i].name);
+	for (i = 0; i < D.len; ++i) {
+		if (D.list[i].fun >= 0) {
+			emit(J, F, OP_CLOSURE);
+			emitraw(J, F, D.list[i].fun);
+			emitstring(J, F, OP_INITVAR, D.list[i].name);
+		}
+	}
+	emitjumpto(J, F, OP_JUMP, body);
+	label(J, F, done);
+	emit(J, F, OP_RETURN);
+
+	js_endtry(J);
+	js_free(J, D.list);
+	return F;
+}
+
+/*
+	Compile a function that was left for later. Its text is parsed again
+	and compiled into a new function, whose code is then moved into F, so
+	F is left untouched if the body has an error.
+*/
+void jsC_compilelazy(js_State *J, js_Function *F, int lazyinner)
+{
+	js_Source *S = F->lazy;
+	js_Function *G, **p;
+	js_Ast *P;
+
+	if (js_try(J)) {
+		jsP_freeparse(J);
+		J->lazysource = NULL;
+		js_throw(J);
+	}
+	P = jsP_parselazy(J, F->filename, S->text, F->lazystart, F->lazyline, lazyinner);
+	J->lazysource = S;
+	G = newfun(J, P->a, P->b, P->c, 0, F->strict);
+	J->lazysource = NULL;
+	jsP_freeparse(J);
+	js_endtry(J);
+
+	F->lightweight = G->lightweight;
+	F->strict = G->strict;
+	F->arguments = G->arguments;
+	F->numparams = G->numparams;
+	F->code = G->code; F->codecap = G->codecap; F->codelen = G->codelen;
+	F->funtab = G->funtab; F->funcap = G->funcap; F->funlen = G->funlen;
+	F->numtab = G->numtab; F->numcap = G->numcap; F->numlen = G->numlen;
+	F->strtab = G->strtab; F->strcap = G->strcap; F->strlen = G->strlen;
+	F->vartab = G->vartab; F->varcap = G->varcap; F->varlen = G->varlen;
+	F->lastline = G->lastline;
+	F->lazy = NULL;
+	if (--S->refs == 0)
+		js_free(J, S);
+
+	/* G is near the head of the list, behind the functions compiled with it */
+	for (p = &J->gcfun; *p != G; p = &(*p)->gcnext)
+		;
+	*p = G->gcnext;
+	js_free(J, G);
+
+	jsG_barrierfunction(J, F);
+}
+
+/* Compile F and all functions inside it that are still left for later */
+void jsC_compiletree(js_State *J, js_Function *F)
+{
+	int i;
+	if (F->lazy)
+		jsC_compilelazy(J, F, 0);
+	else
+		for (i = 0; i < F->funlen; ++i)
+			jsC_compiletree(J, F->funtab[i]);
+}
+
+/* Compile every function left for later, before they are frozen or saved */
+void jsC_compileall(js_State *J)
+{
+	js_Function *fun;
+	for (fun = J->gcfun; fun; fun = fun->gcnext)
+		if (fun->lazy)
+			jsC_compilelazy(J, fun, 0);
+}
@@ -124,6 +124,8 @@ struct js_Function
 	int strict;
 	int arguments;
 	int numparams;
+	int image; /* code and numtab are read from a loaded image, not allocated */
+	int frozen; /* shared with cloned states; never marked, swept or changed */
 
 	js_Instruction *code;
 	int codecap, codelen;
@@ -143,13 +145,40 @@ struct js_Function
 	const char *filename;
 	int line, lastline;
 
+	js_Source *lazy; /* not compiled yet: parse lazy->text + lazystart again when called */
+	int lazystart, lazyline;
+
 	js_Function *gcnext;
 	int gcmark;
 };
 
+/* source text kept for the functions compiled on first call */
+struct js_Source
+{
+	int refs;
+	char text[1];
+};
+
+struct js_CodeEntry
+{
+	js_CodeEntry *hnext; /* next in the same bucket */
+	js_CodeEntry *prev, *next; /* recently used list */
+	js_Function *fun;
+	unsigned int hash;
+	int size, flags;
+	char text[1]; /* file name, parameters and source, each with its terminator */
+};
+
 js_Function *jsC_compilefunction(js_State *J, js_Ast *prog);
 js_Function *jsC_compile(js_State *J, js_Ast *prog);
+js_Function *jsC_compilestream(js_State *J);
+void jsC_compilelazy(js_State *J, js_Function *F, int lazyinner);
+void jsC_compiletree(js_State *J, js_Function *F);
+void jsC_compileall(js_State *J);
+js_Function *jsQ_compile(js_State *J, const char *filename, const char *params, const char *source, int function);
+void jsQ_free(js_State *J);
 const char *jsC_opcodestring(enum js_OpCode opcode);
+int jsK_iscode(const char *data, int size);
 void jc_dump_function(js_State *J, js_Function *fun);
 
 #endif
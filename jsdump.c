@@ -846,7 +846,10 @@ static void js_dumpproperty(js_State *J, js_Property *node)
 	if (node->left->level)
 		js_dumpproperty(J, node->left);
 	printf("\t%s: ", node->name);
-	js_dumpvalue(J, node->value);
+	if (node->atts & JS_ACCESSOR)
+		printf("[Getter/Setter]");
+	else
+		js_dumpvalue(J, node->u.value);
 	printf(",\n");
 	if (node->right->level)
 		js_dumpproperty(J, node->right);
@@ -855,6 +858,7 @@ static void js_dumpproperty(js_State *J, js_Property *node)
 void js_dumpobject(js_State *J, js_Object *obj)
 {
 	printf("{\n");
+	jp_materialize(J, obj);
 	if (obj->properties->level)
 		js_dumpproperty(J, obj->properties);
 	printf("}\n");
@@ -81,6 +81,7 @@ static void js_newerrorx(js_State *J, const char *message, js_Object *prototype)
 		jsB_ErrorX(J, J->Name##_prototype); \
 	} \
 	void js_new##name(js_State *J, const char *s) { \
+		JB_NEED(J, JB_ERROR); \
 		js_newerrorx(J, s, J->Name##_prototype); \
 	} \
 	void js_##name(js_State *J, const char *fmt, ...) { \
@@ -89,6 +90,7 @@ static void js_newerrorx(js_State *J, const char *message, js_Object *prototype)
 		va_start(ap, fmt); \
 		vsnprintf(buf, sizeof buf, fmt, ap); \
 		va_end(ap); \
+		JB_NEED(J, JB_ERROR); \
 		js_newerrorx(J, buf, J->Name##_prototype); \
 		js_throw(J); \
 	}
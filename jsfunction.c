@@ -18,6 +18,9 @@ static void Fp_toString(js_State *J)
 	if (self->type == JS_CFUNCTION || self->type == JS_CSCRIPT) {
 		js_Function *F = self->u.f.function;
 
+		if (F->lazy)
+			jsC_compilelazy(J, F, J->lazycompile);
+
 		if (js_try(J)) {
 			js_free(J, sb);
 			js_throw(J);
@@ -31,6 +34,7 @@ static void Fp_toString(js_State *J)
 			js_puts(J, &sb, F->vartab[i]);
 		}
 		js_puts(J, &sb, ") { ... }");
+		js_putc(J, &sb, 0);
 
 		js_push_string(J, sb->s);
 		js_endtry(J);
@@ -44,6 +48,7 @@ static void Fp_toString(js_State *J)
 		js_puts(J, &sb, "function ");
 		js_puts(J, &sb, self->u.c.name);
 		js_puts(J, &sb, "() { ... }");
+		js_putc(J, &sb, 0);
 
 		js_push_string(J, sb->s);
 		js_endtry(J);
@@ -172,7 +177,6 @@ static void Fp_Function(js_State *J)
 	int i, top = js_gettop(J);
 	js_Buffer *sb = NULL;
 	const char *body;
-	js_Ast *parse;
 	js_Function *fun;
 
 	if (js_try(J)) {
@@ -189,17 +193,16 @@ static void Fp_Function(js_State *J)
 			js_puts(J, &sb, js_tostring(J, i));
 		}
 		js_putc(J, &sb, ')');
+		js_putc(J, &sb, 0);
 	}
 
 	/* body */
 	body = js_is_def(J, top - 1) ? js_tostring(J, top - 1) : "";
 
-	parse = jsP_parsefunction(J, "[string]", sb ? sb->s : NULL, body);
-	fun = jsC_compilefunction(J, parse);
+	fun = jsQ_compile(J, "[string]", sb ? sb->s : NULL, body, 1);
 
 	js_endtry(J);
 	js_free(J, sb);
-	jsP_freeparse(J);
 
 	js_new_function(J, fun, J->GE);
 }
@@ -5,35 +5,52 @@
 
 #include "regexp.h"
 
-static void jsG_markobject(js_State *J, int mark, js_Object *obj);
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#endif
 
 static void jsG_freeenvironment(js_State *J, js_Env *env)
 {
-	js_free(J, env);
+	js_poolfree(J, env, sizeof *env);
 }
 
 static void jsG_freefunction(js_State *J, js_Function *fun)
 {
 	js_free(J, fun->funtab);
-	js_free(J, fun->numtab);
 	js_free(J, fun->strtab);
 	js_free(J, fun->vartab);
-	js_free(J, fun->code);
+	if (!fun->image) {
+		js_free(J, fun->numtab);
+		js_free(J, fun->code);
+	}
+	if (fun->lazy && --fun->lazy->refs == 0)
+		js_free(J, fun->lazy);
 	js_free(J, fun);
 }
 
+/* an AA-tree of 2^31 nodes is less than 64 levels deep, so walk it with a fixed stack */
+#define JS_GCTREEDEPTH 64
+
 static void jsG_freeproperty(js_State *J, js_Property *node)
 {
-	if (node->left->level) jsG_freeproperty(J, node->left);
-	if (node->right->level) jsG_freeproperty(J, node->right);
-	js_free(J, node);
+	js_Property *stack[JS_GCTREEDEPTH];
+	int top = 0;
+	stack[top++] = node;
+	while (top > 0) {
+		node = stack[--top];
+		if (node->left->level) stack[top++] = node->left;
+		if (node->right->level) stack[top++] = node->right;
+		js_poolfree(J, node, sizeof *node);
+	}
 }
 
 static void jsG_freeiterator(js_State *J, js_Iterator *node)
 {
 	while (node) {
 		js_Iterator *next = node->next;
-		js_free(J, node);
+		js_poolfree(J, node, sizeof *node);
 		node = next;
 	}
 }
@@ -44,18 +61,80 @@ static void jsG_freeobject(js_State *J, js_Object *obj)
 		jsG_freeproperty(J, obj->properties);
 	if (obj->type == JS_CREGEXP) {
 		js_free(J, obj->u.r.source);
-		js_regfreex(J->alloc, J->actx, obj->u.r.prog);
+		js_regfreex(js_countalloc, J, obj->u.r.prog);
 	}
 	if (obj->type == JS_CITERATOR)
 		jsG_freeiterator(J, obj->u.iter.head);
-	if (obj->type == JS_CUSERDATA && obj->u.user.finalize)
-		obj->u.user.finalize(J, obj->u.user.data);
-	js_free(J, obj);
+	if (obj->type == JS_CARRAY && obj->u.a.match)
+		js_free(J, obj->u.a.match);
+	if (obj->type == JS_CUSERDATA && obj->u.user.finalize) {
+		/* finalizers may be slow, so run them after the sweep; the dead object is the queue node */
+		obj->gcnext = J->gcfinal;
+		J->gcfinal = obj;
+		return;
+	}
+	js_poolfree(J, obj, sizeof *obj);
+}
+
+static void jsG_freestring(js_State *J, js_String *str)
+{
+	if (str->cells)
+		js_poolfree(J, str, str->cells * JS_POOLQUANTUM);
+	else
+		js_free(J, str);
+}
+
+/*
+	Objects are white (gcmark != J->gcmark), gray (marked and waiting on
+	the gray stack) or black (marked and scanned). A cycle marks the roots,
+	then scans gray objects a budget at a time between allocations, then
+	rescans the roots and drains the gray stack in one atomic step before
+	sweeping the four lists, again a budget at a time. Without
+	JS_GCINCREMENTAL the mark is done in one step but the sweep is still
+	spread over the following allocations.
+
+	Dead userdata objects are not freed by the sweep but queued on
+	J->gcfinal. Their finalizers run after the step, or whenever the
+	host calls js_gcfinalize if it has asked to be told about them.
+
+	The mutator may store a white value into a black object between steps.
+	jsG_barrier catches every such store into a property and grays the
+	value. The stack and environment chains are rescanned in the atomic
+	step, so they need no barrier.
+
+	In generational mode the mark is not flipped between minor collections,
+	so everything that survived the last collection stays black (old) and
+	everything allocated since is white (young). The lists are only swept
+	up to the first old node. The barrier is always on, and the gray stack
+	doubles as the remembered set: young values stored into old objects
+	wait on it to be scanned by the next minor collection. A major
+	collection flips the mark and traces everything.
+*/
+
+static void jsG_grayobject(js_State *J, js_Object *obj)
+{
+	obj->gcmark = J->gcmark;
+	if (J->gcgray.top == J->gcgray.cap) {
+		js_Object **stack = NULL;
+		int cap = J->gcgray.cap ? J->gcgray.cap * 2 : 256;
+		if (cap <= JS_GRAYLIMIT)
+			stack = J->alloc(J->actx, J->gcgray.stack, cap * sizeof *stack);
+		if (!stack) {
+			/* leave it marked but unscanned; jsG_propagate rescans the heap */
+			J->gcgray.overflow = 1;
+			return;
+		}
+		J->gcgray.stack = stack;
+		J->gcgray.cap = cap;
+	}
+	J->gcgray.stack[J->gcgray.top++] = obj;
 }
 
 static void jsG_markfunction(js_State *J, int mark, js_Function *fun)
 {
 	int i;
+	if (fun->frozen)
+		return;
 	fun->gcmark = mark;
 	for (i = 0; i < fun->funlen; ++i)
 		if (fun->funtab[i]->gcmark != mark)
@@ -67,35 +146,59 @@ static void jsG_markenvironment(js_State *J, int mark, js_Env *env)
 	do {
 		env->gcmark = mark;
 		if (env->variables->gcmark != mark)
-			jsG_markobject(J, mark, env->variables);
+			jsG_grayobject(J, env->variables);
 		env = env->outer;
 	} while (env && env->gcmark != mark);
 }
 
+static void jsG_markobject(js_State *J, int mark, js_Object *obj)
+{
+	if (obj && obj->gcmark != mark)
+		jsG_grayobject(J, obj);
+}
+
+static void jsG_markvalue(js_State *J, int mark, js_Value *v)
+{
+	if (v->type == JS_TMEMSTR && v->u.memstr->gcmark != mark)
+		v->u.memstr->gcmark = mark;
+	if (v->type == JS_TOBJECT && v->u.object->gcmark != mark)
+		jsG_grayobject(J, v->u.object);
+}
+
 static void jsG_markproperty(js_State *J, int mark, js_Property *node)
 {
-	if (node->left->level) jsG_markproperty(J, mark, node->left);
-	if (node->right->level) jsG_markproperty(J, mark, node->right);
+	js_Property *stack[JS_GCTREEDEPTH];
+	int top = 0;
+	stack[top++] = node;
+	while (top > 0) {
+		node = stack[--top];
+		if (node->left->level) stack[top++] = node->left;
+		if (node->right->level) stack[top++] = node->right;
 
-	if (node->value.type == JS_TMEMSTR && node->value.u.memstr->gcmark != mark)
-		node->value.u.memstr->gcmark = mark;
-	if (node->value.type == JS_TOBJECT && node->value.u.object->gcmark != mark)
-		jsG_markobject(J, mark, node->value.u.object);
-	if (node->getter && node->getter->gcmark != mark)
-		jsG_markobject(J, mark, node->getter);
-	if (node->setter && node->setter->gcmark != mark)
-		jsG_markobject(J, mark, node->setter);
+		if (node->atts & JS_ACCESSOR) {
+			if (node->u.acc.getter && node->u.acc.getter->gcmark != mark)
+				jsG_grayobject(J, node->u.acc.getter);
+			if (node->u.acc.setter && node->u.acc.setter->gcmark != mark)
+				jsG_grayobject(J, node->u.acc.setter);
+		} else {
+			jsG_markvalue(J, mark, &node->u.value);
+		}
+	}
 }
 
-static void jsG_markobject(js_State *J, int mark, js_Object *obj)
+/* Scan a gray object, returning the amount of work done */
+static int jsG_scanobject(js_State *J, int mark, js_Object *obj)
 {
-	obj->gcmark = mark;
 	if (obj->properties->level)
 		jsG_markproperty(J, mark, obj->properties);
 	if (obj->prototype && obj->prototype->gcmark != mark)
-		jsG_markobject(J, mark, obj->prototype);
+		jsG_grayobject(J, obj->prototype);
 	if (obj->type == JS_CITERATOR) {
-		jsG_markobject(J, mark, obj->u.iter.target);
+		if (obj->u.iter.target->gcmark != mark)
+			jsG_grayobject(J, obj->u.iter.target);
+	}
+	if (obj->type == JS_CARRAY && obj->u.a.match) {
+		jsG_markvalue(J, mark, &obj->u.a.match->input);
 	}
 	if (obj->type == JS_CFUNCTION || obj->type == JS_CSCRIPT) {
 		if (obj->u.f.scope && obj->u.f.scope->gcmark != mark)
@@ -103,34 +206,22 @@ static void jsG_markobject(js_State *J, int mark, js_Object *obj)
 		if (obj->u.f.function && obj->u.f.function->gcmark != mark)
 			jsG_markfunction(J, mark, obj->u.f.function);
 	}
+	return 1 + obj->count;
 }
 
 static void jsG_markstack(js_State *J, int mark)
 {
 	js_Value *v = J->stack;
 	int n = J->top;
-	while (n--) {
-		if (v->type == JS_TMEMSTR && v->u.memstr->gcmark != mark)
-			v->u.memstr->gcmark = mark;
-		if (v->type == JS_TOBJECT && v->u.object->gcmark != mark)
-			jsG_markobject(J, mark, v->u.object);
-		++v;
-	}
+	while (n--)
+		jsG_markvalue(J, mark, v++);
 }
 
-void js_gc(js_State *J, int report)
+static void jsG_markroots(js_State *J, int mark)
 {
-	js_Function *fun, *nextfun, **prevnextfun;
-	js_Object *obj, *nextobj, **prevnextobj;
-	js_String *str, *nextstr, **prevnextstr;
-	js_Env *env, *nextenv, **prevnextenv;
-	int nenv = 0, nfun = 0, nobj = 0, nstr = 0;
-	int genv = 0, gfun = 0, gobj = 0, gstr = 0;
-	int mark;
+	js_CodeEntry *e;
 	int i;
 
-	mark = J->gcmark = J->gcmark == 1 ? 2 : 1;
-
 	jsG_markobject(J, mark, J->Object_prototype);
 	jsG_markobject(J, mark, J->Array_prototype);
 	jsG_markobject(J, mark, J->Function_prototype);
@@ -158,72 +249,606 @@ void js_gc(js_State *J, int report)
 	for (i = 0; i < J->envtop; ++i)
 		jsG_markenvironment(J, mark, J->envstack[i]);
 
-	prevnextenv = &J->gcenv;
-	for (env = J->gcenv; env; env = nextenv) {
-		nextenv = env->gcnext;
+	for (i = 0, e = J->codelru; i < J->codecount; ++i, e = e->next)
+		if (e->fun->gcmark != mark)
+			jsG_markfunction(J, mark, e->fun);
+}
+
+/* fun was compiled after it was made, and may be black with white inner functions */
+void jsG_barrierfunction(js_State *J, js_Function *fun)
+{
+	if ((J->gcstate == JS_GCMARK || J->gcgenerational) && fun->gcmark == J->gcmark)
+		jsG_markfunction(J, J->gcmark, fun);
+}
+
+/* obj is the object stored into, or NULL if it is not known */
+void jsG_barrier(js_State *J, js_Object *obj, js_Value *v)
+{
+	if ((J->gcstate == JS_GCMARK || J->gcgenerational) && (!obj || obj->gcmark == J->gcmark))
+		jsG_markvalue(J, J->gcmark, v);
+}
+
+void jsG_barrierobject(js_State *J, js_Object *obj, js_Object *v)
+{
+	if ((J->gcstate == JS_GCMARK || J->gcgenerational) && obj->gcmark == J->gcmark)
+		if (v && v->gcmark != J->gcmark)
+			jsG_grayobject(J, v);
+}
+
+static void jsG_clearcounts(js_State *J)
+{
+	J->gcnenv = J->gcnfun = J->gcnobj = J->gcnstr = 0;
+	J->gcgenv = J->gcgfun = J->gcgobj = J->gcgstr = 0;
+}
+
+static void jsG_begin(js_State *J)
+{
+	J->gcmark = J->gcmark == 1 ? 2 : 1;
+	J->gcstate = JS_GCMARK;
+	J->gcgray.top = 0; /* anything left by the barrier is traced anew */
+	J->gcgray.overflow = 0;
+	jsG_clearcounts(J);
+	jsG_markroots(J, J->gcmark);
+}
+
+/*
+	Scan gray objects until the budget runs out; return 1 when none are left.
+	If the gray stack could not hold an object, it was left marked but not
+	scanned. Scanning every marked object again finds what it points to.
+	That may overflow again, but each pass marks something new.
+*/
+static int jsG_propagate(js_State *J, int *budget)
+{
+	js_Object *obj;
+	for (;;) {
+		while (J->gcgray.top > 0) {
+			if (*budget <= 0)
+				return 0;
+			*budget -= jsG_scanobject(J, J->gcmark, J->gcgray.stack[--J->gcgray.top]);
+		}
+		if (!J->gcgray.overflow)
+			return 1;
+		J->gcgray.overflow = 0;
+		for (obj = J->gcobj; obj; obj = obj->gcnext)
+			if (obj->gcmark == J->gcmark)
+				*budget -= jsG_scanobject(J, J->gcmark, obj);
+	}
+}
+
+static void jsG_atomic(js_State *J, int minor)
+{
+	int budget = INT_MAX;
+
+	jsG_markroots(J, J->gcmark);
+	jsG_propagate(J, &budget);
+
+	J->gcstate = JS_GCSWEEP;
+	J->gcminor = minor;
+	++J->gcsweeps;
+	if (!minor) {
+		J->gcoldenv = NULL;
+		J->gcoldfun = NULL;
+		J->gcoldobj = NULL;
+		J->gcoldstr = NULL;
+	}
+	J->gcsweepenv = &J->gcenv;
+	J->gcsweepfun = &J->gcfun;
+	J->gcsweepobj = &J->gcobj;
+	J->gcsweepstr = &J->gcstr;
+}
+
+/* Sweep the lists in order until the budget runs out; return 1 when done */
+static int jsG_sweep(js_State *J, int *budget)
+{
+	int mark = J->gcmark;
+	js_Env *env;
+	js_Function *fun;
+	js_Object *obj;
+	js_String *str;
+
+	while ((env = *J->gcsweepenv) != J->gcoldenv) {
+		if ((*budget)-- <= 0)
+			return 0;
 		if (env->gcmark != mark) {
-			*prevnextenv = nextenv;
+			*J->gcsweepenv = env->gcnext;
 			jsG_freeenvironment(J, env);
-			++genv;
+			++J->gcgenv;
 		} else {
-			prevnextenv = &env->gcnext;
+			J->gcsweepenv = &env->gcnext;
 		}
-		++nenv;
+		++J->gcnenv;
 	}
 
-	prevnextfun = &J->gcfun;
-	for (fun = J->gcfun; fun; fun = nextfun) {
-		nextfun = fun->gcnext;
+	while ((fun = *J->gcsweepfun) != J->gcoldfun) {
+		if ((*budget)-- <= 0)
+			return 0;
 		if (fun->gcmark != mark) {
-			*prevnextfun = nextfun;
+			*J->gcsweepfun = fun->gcnext;
 			jsG_freefunction(J, fun);
-			++gfun;
+			++J->gcgfun;
 		} else {
-			prevnextfun = &fun->gcnext;
+			J->gcsweepfun = &fun->gcnext;
 		}
-		++nfun;
+		++J->gcnfun;
 	}
 
-	prevnextobj = &J->gcobj;
-	for (obj = J->gcobj; obj; obj = nextobj) {
-		nextobj = obj->gcnext;
+	while ((obj = *J->gcsweepobj) != J->gcoldobj) {
+		if ((*budget)-- <= 0)
+			return 0;
 		if (obj->gcmark != mark) {
-			*prevnextobj = nextobj;
+			*J->gcsweepobj = obj->gcnext;
 			jsG_freeobject(J, obj);
-			++gobj;
+			++J->gcgobj;
 		} else {
-			prevnextobj = &obj->gcnext;
+			J->gcsweepobj = &obj->gcnext;
 		}
-		++nobj;
+		++J->gcnobj;
 	}
 
-	prevnextstr = &J->gcstr;
-	for (str = J->gcstr; str; str = nextstr) {
-		nextstr = str->gcnext;
+	while ((str = *J->gcsweepstr) != J->gcoldstr) {
+		if ((*budget)-- <= 0)
+			return 0;
 		if (str->gcmark != mark) {
-			*prevnextstr = nextstr;
-			js_free(J, str);
-			++gstr;
+			*J->gcsweepstr = str->gcnext;
+			jsG_freestring(J, str);
+			++J->gcgstr;
 		} else {
-			prevnextstr = &str->gcnext;
+			J->gcsweepstr = &str->gcnext;
 		}
-		++nstr;
+		++J->gcnstr;
+	}
+
+	/* the heap may now grow by gcpause percent before the next full collection */
+	if (!J->gcminor) {
+		J->gcmajor = J->gcbytes / 100 * J->gcpause;
+		if (J->gcmajor < (size_t)J->gcminheap * 1024)
+			J->gcmajor = (size_t)J->gcminheap * 1024;
+	}
+
+	if (J->gcminor)
+		++J->gcstats.minors;
+	else
+		++J->gcstats.collections;
+
+	/* everything left is now old */
+	J->gcoldenv = J->gcenv;
+	J->gcoldfun = J->gcfun;
+	J->gcoldobj = J->gcobj;
+	J->gcoldstr = J->gcstr;
+
+	J->gcstate = JS_GCIDLE;
+	return 1;
+}
+
+static void jsG_finish(js_State *J)
+{
+	int budget = INT_MAX;
+	if (J->gcstate == JS_GCMARK)
+		jsG_atomic(J, 0);
+	if (J->gcstate == JS_GCSWEEP)
+		jsG_sweep(J, &budget);
+}
+
+/* Collect the young generation: everything allocated since the last collection */
+static void jsG_minor(js_State *J)
+{
+	int budget = INT_MAX;
+	jsG_clearcounts(J);
+	jsG_atomic(J, 1);
+	jsG_sweep(J, &budget);
+}
+
+/* Run the queued finalizers now, unless the host wants to schedule them */
+static void jsG_pending(js_State *J)
+{
+	if (J->gcfinal) {
+		if (J->finalize)
+			J->finalize(J);
+		else
+			js_gcfinalize(J, 0);
+	}
+}
+
+int js_gcfinalize(js_State *J, int n)
+{
+	js_Object *obj;
+	js_Finalize finalize;
+	void *data;
+	int count = 0;
+	while ((obj = J->gcfinal) && (n <= 0 || count < n)) {
+		J->gcfinal = obj->gcnext;
+		finalize = obj->u.user.finalize;
+		data = obj->u.user.data;
+		js_poolfree(J, obj, sizeof *obj);
+		finalize(J, data);
+		++count;
+	}
+	return count;
+}
+
+js_Notify js_atfinalize(js_State *J, js_Notify notify)
+{
+	js_Notify old = J->finalize;
+	J->finalize = notify;
+	return old;
+}
+
+/* Decide how many more bytes to allocate before jsG_step is called again */
+static void jsG_setlimit(js_State *J)
+{
+	size_t room;
+	if (J->gcurgent) {
+		/* collect again at the next safe point */
+		J->gclimit = 0;
+		return;
 	}
+	if (J->gcstate != JS_GCIDLE)
+		J->gclimit = J->gcbytes + (size_t)J->gcstepsize * 1024;
+	else if (J->gcgenerational)
+		J->gclimit = J->gcbytes + (size_t)J->gcnursery * 1024;
+	else
+		J->gclimit = J->gcmajor;
+	/* come back when half the room left under the memory limit is used */
+	if (J->memlimit) {
+		room = J->gcbytes < J->memlimit ? (J->memlimit - J->gcbytes) / 2 : 0;
+		if (J->gclimit > J->gcbytes + room)
+			J->gclimit = J->gcbytes + room;
+	}
+}
+
+/* Finish a sweep in progress; it only frees what was already dead, so any allocation may call it */
+void jsG_sweepall(js_State *J)
+{
+	int budget = INT_MAX;
+	if (J->gcstate == JS_GCSWEEP) {
+		jsG_sweep(J, &budget);
+		jsG_setlimit(J);
+	}
+}
+
+/* Finish any cycle in progress, then collect everything */
+static void jsG_full(js_State *J)
+{
+	jsG_finish(J);
+	jsG_begin(J);
+	jsG_finish(J);
+}
+
+/* Wall clock seconds from some fixed time, to measure pauses with */
+static double jsG_now(void)
+{
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#elif defined(__unix__) || defined(__APPLE__)
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+#elif defined(_WIN32) && defined(TIME_UTC)
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC; /* processor time; the best left */
+#endif
+}
+
+static void jsG_pause(js_State *J, double start)
+{
+	double t = jsG_now() - start;
+	if (t < 0)
+		t = 0; /* the wall clock was set back */
+	int i = 0;
+	while (i < JS_GCHISTOGRAM - 1 && t * 1e6 >= (1 << i))
+		++i;
+	++J->gcstats.histogram[i];
+	++J->gcstats.pauses;
+	J->gcstats.pausetime += t;
+	if (t > J->gcstats.pausemax)
+		J->gcstats.pausemax = t;
+}
+
+void jsG_step(js_State *J)
+{
+	double start = jsG_now();
+	size_t before = J->gcbytes;
+	int budget;
+
+	if (J->gcurgent) {
+		/*
+			A block was refused. What the script dropped when it caught the
+			error may only become garbage a few instructions later, so keep
+			collecting until one collection frees as much as was asked for.
+		*/
+		jsG_full(J);
+		if (--J->gcurgent == 0 || J->gcbytes + J->gcneed <= before)
+			J->gcurgent = 0;
+	} else if (J->memlimit && J->gcbytes > J->memlimit / 4 * 3) {
+		/* close to the memory limit; collect everything we can */
+		jsG_full(J);
+	} else if (J->gcgenerational) {
+		if (J->gcbytes < J->gcmajor)
+			jsG_minor(J);
+		else
+			jsG_full(J);
+	} else if (J->gcstate != JS_GCIDLE && J->gcbytes / J->gcpause > J->gcmajor / 100) {
+		/* the cycle fell behind and the heap grew as much again while it ran; finish it now */
+		jsG_full(J);
+	} else {
+		budget = J->gcstepsize * J->gcstepmul;
+		if (J->gcstate == JS_GCIDLE)
+			jsG_begin(J);
+		if (J->gcstate == JS_GCMARK && (!J->gcincremental || jsG_propagate(J, &budget)))
+			jsG_atomic(J, 0);
+		if (J->gcstate == JS_GCSWEEP)
+			jsG_sweep(J, &budget);
+	}
+
+	/* take back the reserve once there is as much room under the memory limit */
+	if (J->memfault && J->gcbytes + JS_MEMRESERVE * 1024 < J->memlimit)
+		J->memfault = 0;
+
+	jsG_setlimit(J);
+	jsG_pause(J, start);
+	jsG_pending(J);
+}
+
+void js_gc(js_State *J, int report)
+{
+	double start = jsG_now();
+
+	jsG_full(J);
+
+	jsG_setlimit(J);
+	jsG_pause(J, start);
+	jsG_pending(J);
 
 	if (report) {
 		char buf[256];
 		snprintf(buf, sizeof buf, "garbage collected: %d/%d envs, %d/%d funs, %d/%d objs, %d/%d strs",
-			genv, nenv, gfun, nfun, gobj, nobj, gstr, nstr);
+			J->gcgenv, J->gcnenv, J->gcgfun, J->gcnfun, J->gcgobj, J->gcnobj, J->gcgstr, J->gcnstr);
 		js_report(J, buf);
 	}
 }
 
+void js_gcstats(js_State *J, js_GCStats *stats)
+{
+	*stats = J->gcstats;
+}
+
+/* Bytes owned by a node, not counting properties */
+
+int jsG_objectsize(js_Object *obj)
+{
+	js_Iterator *node;
+	int size = JS_POOLSIZE(sizeof *obj);
+	if (obj->type == JS_CREGEXP)
+		size += js_blocksize(obj->u.r.source) + js_blocksize(obj->u.r.prog);
+	if (obj->type == JS_CARRAY)
+		size += js_blocksize(obj->u.a.match);
+	if (obj->type == JS_CITERATOR)
+		for (node = obj->u.iter.head; node; node = node->next)
+			size += JS_POOLSIZE(sizeof *node);
+	return size;
+}
+
+int jsG_functionsize(js_Function *fun)
+{
+	int size = js_blocksize(fun) + js_blocksize(fun->funtab) +
+		js_blocksize(fun->strtab) + js_blocksize(fun->vartab);
+	if (!fun->image)
+		size += js_blocksize(fun->code) + js_blocksize(fun->numtab);
+	return size;
+}
+
+int jsG_stringsize(js_String *str)
+{
+	return str->cells ? str->cells * JS_POOLQUANTUM : js_blocksize(str);
+}
+
+void js_memstats(js_State *J, js_MemStats *stats)
+{
+	js_Env *env;
+	js_Function *fun;
+	js_Object *obj;
+	js_String *str;
+	void *page;
+
+	memset(stats, 0, sizeof *stats);
+	stats->bytes = J->gcbytes;
+
+	for (page = J->poolpages; page; page = *(void **)page)
+		stats->pages += JS_POOLPAGE;
+
+	for (env = J->gcenv; env; env = env->gcnext) {
+		++stats->environments;
+		stats->envbytes += JS_POOLSIZE(sizeof *env);
+	}
+
+	for (fun = J->gcfun; fun; fun = fun->gcnext) {
+		++stats->functions;
+		stats->funbytes += jsG_functionsize(fun);
+	}
+
+	for (obj = J->gcobj; obj; obj = obj->gcnext) {
+		++stats->objects;
+		++stats->classes[obj->type];
+		stats->objbytes += jsG_objectsize(obj);
+		stats->properties += obj->count;
+	}
+	stats->propbytes = stats->properties * JS_POOLSIZE(sizeof (js_Property));
+
+	for (obj = J->gcfinal; obj; obj = obj->gcnext)
+		++stats->finalizers;
+
+	for (str = J->gcstr; str; str = str->gcnext) {
+		++stats->strings;
+		stats->strbytes += jsG_stringsize(str);
+	}
+
+	jn_memstats(J, stats);
+}
+
+size_t js_setmemlimit(js_State *J, size_t limit)
+{
+	size_t old = J->memlimit;
+	J->memlimit = limit;
+	J->memfault = 0;
+	J->gcurgent = 0;
+	jsG_setlimit(J);
+	return old;
+}
+
+int js_gcparam(js_State *J, int param, int value)
+{
+	int old;
+	switch (param) {
+	case JS_GCINCREMENTAL:
+		old = J->gcincremental;
+		if (old && !value)
+			jsG_finish(J);
+		if (value)
+			J->gcgenerational = 0;
+		J->gcincremental = value != 0;
+		jsG_setlimit(J);
+		return old;
+	case JS_GCGENERATIONAL:
+		old = J->gcgenerational;
+		if (value && !old) {
+			/* old objects have not been watched by the barrier; start with a major collection */
+			jsG_finish(J);
+			J->gcincremental = 0;
+			J->gcmajor = 0;
+		}
+		J->gcgenerational = value != 0;
+		jsG_setlimit(J);
+		return old;
+	case JS_GCSTEPSIZE:
+		old = J->gcstepsize;
+		if (value > 0)
+			J->gcstepsize = value;
+		break;
+	case JS_GCSTEPMUL:
+		old = J->gcstepmul;
+		if (value > 0)
+			J->gcstepmul = value < JS_GCWORKMIN ? JS_GCWORKMIN : value;
+		break;
+	case JS_GCPAUSE:
+		old = J->gcpause;
+		if (value > 100)
+			J->gcpause = value;
+		break;
+	case JS_GCMINHEAP:
+		old = J->gcminheap;
+		if (value > 0)
+			J->gcminheap = value;
+		break;
+	case JS_GCNURSERY:
+		old = J->gcnursery;
+		if (value > 0)
+			J->gcnursery = value;
+		break;
+	default:
+		js_error(J, "unknown gc parameter: %d", param);
+	}
+	jsG_setlimit(J);
+	return old;
+}
+
+/* Shared blocks may be released by states on different threads */
+#if defined(__GNUC__)
+#define jsG_addref(p, n) __sync_add_and_fetch(p, n)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define jsG_addref(p, n) (_InterlockedExchangeAdd((long *)(p), n) + (n))
+#else
+#define jsG_addref(p, n) (*(p) += (n))
+#endif
+
+/* Move the state's functions and interned strings into a new shared block */
+void jsG_freeze(js_State *J)
+{
+	js_Shared *S;
+	js_Function *fun;
+
+	jsC_compileall(J);
+	jsG_finish(J);
+	if (!J->gcfun && !J->strings)
+		return;
+
+	S = js_malloc(J, sizeof *S);
+	J->gcbytes -= js_blocksize(S);
+	S->refs = 1;
+	S->alloc = J->alloc;
+	S->actx = J->actx;
+	S->parent = J->shared;
+	S->fun = J->gcfun;
+	for (fun = J->gcfun; fun; fun = fun->gcnext) {
+		J->gcbytes -= jsG_functionsize(fun);
+		fun->frozen = 1;
+	}
+	jn_freeze(J, S);
+	J->shared = S;
+	J->gcfun = NULL;
+	J->gcoldfun = NULL;
+}
+
+void jsG_retain(js_Shared *S)
+{
+	if (S)
+		jsG_addref(&S->refs, 1);
+}
+
+static void jsG_freefrozen(js_Shared *S, js_Function *fun)
+{
+	js_freeblock(S->alloc, S->actx, fun->funtab);
+	js_freeblock(S->alloc, S->actx, fun->strtab);
+	js_freeblock(S->alloc, S->actx, fun->vartab);
+	if (!fun->image) {
+		js_freeblock(S->alloc, S->actx, fun->numtab);
+		js_freeblock(S->alloc, S->actx, fun->code);
+	}
+	js_freeblock(S->alloc, S->actx, fun);
+}
+
+void jsG_release(js_Shared *S)
+{
+	js_Function *fun, *nextfun;
+	js_Shared *parent;
+	while (S && jsG_addref(&S->refs, -1) == 0) {
+		for (fun = S->fun; fun; fun = nextfun)
+			nextfun = fun->gcnext, jsG_freefrozen(S, fun);
+		jn_freeshared(S);
+		parent = S->parent;
+		js_freeblock(S->alloc, S->actx, S);
+		S = parent;
+	}
+}
+
+/* Keep a module's block until the state is freed */
+void jsG_holdmodule(js_State *J, js_Shared *S)
+{
+	int i;
+	for (i = 0; i < J->nmodules; ++i)
+		if (J->modules[i] == S)
+			return;
+	if (J->nmodules == J->modulecap) {
+		J->modulecap = J->modulecap ? J->modulecap * 2 : 8;
+		J->modules = js_realloc(J, J->modules, J->modulecap * sizeof *J->modules);
+	}
+	jsG_retain(S);
+	J->modules[J->nmodules++] = S;
+}
+
 void js_freestate(js_State *J)
 {
 	js_Function *fun, *nextfun;
 	js_Object *obj, *nextobj;
 	js_Env *env, *nextenv;
 	js_String *str, *nextstr;
+	void *page, *nextpage;
+	int i;
 
 	if (!J)
 		return;
@@ -234,12 +859,23 @@ void js_freestate(js_State *J)
 		nextfun = fun->gcnext, jsG_freefunction(J, fun);
 	for (obj = J->gcobj; obj; obj = nextobj)
 		nextobj = obj->gcnext, jsG_freeobject(J, obj);
+	js_gcfinalize(J, 0);
 	for (str = J->gcstr; str; str = nextstr)
-		nextstr = str->gcnext, js_free(J, str);
+		nextstr = str->gcnext, jsG_freestring(J, str);
 
+	jsQ_free(J);
 	jn_free_strings(J);
+	jsG_release(J->shared);
+	for (i = 0; i < J->nmodules; ++i)
+		jsG_release(J->modules[i]);
+	js_free(J, J->modules);
+
+	for (page = J->poolpages; page; page = nextpage)
+		nextpage = *(void **)page, J->alloc(J->actx, page, 0);
 
+	J->alloc(J->actx, J->gcgray.stack, 0);
 	js_free(J, J->lexbuf.text);
+	js_free(J, J->lexcache);
 	J->alloc(J->actx, J->stack, 0);
 	J->alloc(J->actx, J, 0);
 }
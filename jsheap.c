@@ -0,0 +1,362 @@
+#include "jsi.h"
+#include "jscompile.h"
+#include "jsvalue.h"
+#include "jsrun.h"
+
+/*
+	Write the heap as a DevTools heap snapshot (.heapsnapshot), which is
+	plain JSON. The nodes are a synthetic root, then every environment,
+	function, object and heap string, sorted by address so a reference can
+	be turned into a node index by binary search. The edges are the same
+	references the collector follows, and the root's edges are its roots.
+	The viewer works out retainers, retaining paths and dominators from
+	these edges.
+*/
+
+enum { H_HIDDEN, H_ARRAY, H_STRING, H_OBJECT, H_CODE, H_CLOSURE, H_REGEXP, H_NUMBER, H_NATIVE, H_SYNTHETIC };
+enum { H_CONTEXT, H_ELEMENT, H_PROPERTY, H_INTERNAL };
+enum { H_NODEFIELDS = 6 };
+
+typedef struct { const void *ptr; int kind; } jsH_Node;
+typedef struct { const char *prefix, *s; } jsH_String;
+
+typedef struct
+{
+	FILE *f;
+	jsH_Node *node;
+	int nnode;
+	jsH_String *str;
+	int nstr, strcap;
+	int nedge;
+	int count; /* only count the edges */
+	const char *sep;
+} jsH_Dump;
+
+static const char *jsH_classname[] = {
+	"Object", "Array", "Function", "Script", "Function", "Error",
+	"Boolean", "Number", "String", "RegExp", "Date", "Math", "JSON",
+	"Iterator", "Userdata",
+};
+
+static const char *jsH_objectname(js_Object *obj)
+{
+	if ((obj->type == JS_CFUNCTION || obj->type == JS_CSCRIPT) && obj->u.f.function)
+		return obj->u.f.function->name;
+	if (obj->type == JS_CCFUNCTION)
+		return obj->u.c.name;
+	if (obj->type == JS_CUSERDATA)
+		return obj->u.user.tag;
+	return jsH_classname[obj->type];
+}
+
+static int jsH_cmp(const void *a, const void *b)
+{
+	const char *x = ((const jsH_Node *)a)->ptr;
+	const char *y = ((const jsH_Node *)b)->ptr;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* node index of ptr, or -1 if it is not on the heap */
+static int jsH_find(jsH_Dump *d, const void *ptr)
+{
+	int lo = 0, hi = d->nnode - 1, mid;
+	while (lo <= hi) {
+		mid = (lo + hi) >> 1;
+		if ((const char *)ptr < (const char *)d->node[mid].ptr)
+			hi = mid - 1;
+		else if ((const char *)ptr > (const char *)d->node[mid].ptr)
+			lo = mid + 1;
+		else
+			return mid + 1;
+	}
+	return -1;
+}
+
+static int jsH_string(js_State *J, jsH_Dump *d, const char *prefix, const char *s)
+{
+	if (d->nstr == d->strcap) {
+		d->strcap = d->strcap ? d->strcap * 2 : 256;
+		d->str = js_realloc(J, d->str, d->strcap * sizeof *d->str);
+	}
+	d->str[d->nstr].prefix = prefix;
+	d->str[d->nstr].s = s;
+	return d->nstr++;
+}
+
+static void jsH_putstring(FILE *f, const char *s)
+{
+	int c;
+	while ((c = (unsigned char)*s++)) {
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			putc(c, f);
+	}
+}
+
+static void jsH_edge(js_State *J, jsH_Dump *d, int type, const char *prefix, const char *name, const void *to)
+{
+	int i = jsH_find(d, to);
+	if (i < 0)
+		return;
+	if (d->count) {
+		++d->nedge;
+		return;
+	}
+	fprintf(d->f, "%s%d,%d,%d\n", d->sep, type, jsH_string(J, d, prefix, name), i * H_NODEFIELDS);
+	d->sep = ",";
+}
+
+static void jsH_element(jsH_Dump *d, int index, const void *to)
+{
+	int i = jsH_find(d, to);
+	if (i < 0)
+		return;
+	if (d->count) {
+		++d->nedge;
+		return;
+	}
+	fprintf(d->f, "%s%d,%d,%d\n", d->sep, H_ELEMENT, index, i * H_NODEFIELDS);
+	d->sep = ",";
+}
+
+static void jsH_value(js_State *J, jsH_Dump *d, int type, const char *name, js_Value *v)
+{
+	if (v->type == JS_TOBJECT)
+		jsH_edge(J, d, type, "", name, v->u.object);
+	else if (v->type == JS_TMEMSTR)
+		jsH_edge(J, d, type, "", name, v->u.memstr);
+}
+
+static void jsH_properties(js_State *J, jsH_Dump *d, js_Property *node)
+{
+	js_Property *stack[64]; /* AA-tree depth, as in jsgc.c */
+	int top = 0;
+	stack[top++] = node;
+	while (top > 0) {
+		node = stack[--top];
+		if (node->left->level) stack[top++] = node->left;
+		if (node->right->level) stack[top++] = node->right;
+		if (node->atts & JS_ACCESSOR) {
+			if (node->u.acc.getter)
+				jsH_edge(J, d, H_PROPERTY, "get ", node->name, node->u.acc.getter);
+			if (node->u.acc.setter)
+				jsH_edge(J, d, H_PROPERTY, "set ", node->name, node->u.acc.setter);
+		} else {
+			jsH_value(J, d, H_PROPERTY, node->name, &node->u.value);
+		}
+	}
+}
+
+static void jsH_edges(js_State *J, jsH_Dump *d, jsH_Node *n)
+{
+	js_Env *env;
+	js_Function *fun;
+	js_Object *obj;
+	int i;
+
+	switch (n->kind) {
+	case H_HIDDEN:
+		env = (js_Env *)n->ptr;
+		jsH_edge(J, d, H_INTERNAL, "", "variables", env->variables);
+		if (env->outer)
+			jsH_edge(J, d, H_INTERNAL, "", "outer", env->outer);
+		break;
+	case H_CODE:
+		fun = (js_Function *)n->ptr;
+		for (i = 0; i < fun->funlen; ++i)
+			jsH_element(d, i, fun->funtab[i]);
+		break;
+	case H_OBJECT:
+		obj = (js_Object *)n->ptr;
+		if (obj->properties->level)
+			jsH_properties(J, d, obj->properties);
+		if (obj->prototype)
+			jsH_edge(J, d, H_PROPERTY, "", "__proto__", obj->prototype);
+		if (obj->type == JS_CITERATOR)
+			jsH_edge(J, d, H_INTERNAL, "", "target", obj->u.iter.target);
+		if (obj->type == JS_CARRAY && obj->u.a.match)
+			jsH_value(J, d, H_INTERNAL, "input", &obj->u.a.match->input);
+		if (obj->type == JS_CFUNCTION || obj->type == JS_CSCRIPT) {
+			if (obj->u.f.scope)
+				jsH_edge(J, d, H_CONTEXT, "", "scope", obj->u.f.scope);
+			if (obj->u.f.function)
+				jsH_edge(J, d, H_INTERNAL, "", "code", obj->u.f.function);
+		}
+		break;
+	}
+}
+
+static void jsH_roots(js_State *J, jsH_Dump *d)
+{
+	int i;
+
+	jsH_edge(J, d, H_PROPERTY, "", "Object.prototype", J->Object_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "Array.prototype", J->Array_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "Function.prototype", J->Function_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "Boolean.prototype", J->Boolean_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "Number.prototype", J->Number_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "String.prototype", J->String_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "RegExp.prototype", J->RegExp_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "Date.prototype", J->Date_prototype);
+
+	jsH_edge(J, d, H_PROPERTY, "", "Error.prototype", J->Error_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "EvalError.prototype", J->EvalError_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "RangeError.prototype", J->RangeError_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "ReferenceError.prototype", J->ReferenceError_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "SyntaxError.prototype", J->SyntaxError_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "TypeError.prototype", J->TypeError_prototype);
+	jsH_edge(J, d, H_PROPERTY, "", "URIError.prototype", J->URIError_prototype);
+
+	jsH_edge(J, d, H_INTERNAL, "", "(registry)", J->R);
+	jsH_edge(J, d, H_INTERNAL, "", "(global)", J->G);
+
+	for (i = 0; i < J->top; ++i)
+		jsH_value(J, d, H_INTERNAL, "(stack)", &J->stack[i]);
+
+	jsH_edge(J, d, H_INTERNAL, "", "(environment)", J->E);
+	jsH_edge(J, d, H_INTERNAL, "", "(global environment)", J->GE);
+	for (i = 0; i < J->envtop; ++i)
+		jsH_edge(J, d, H_INTERNAL, "", "(saved environment)", J->envstack[i]);
+}
+
+static void jsH_writenode(js_State *J, jsH_Dump *d, int i, int type, const char *name, int size)
+{
+	fprintf(d->f, "%s%d,%d,%d,%d,%d,0\n", d->sep, type, jsH_string(J, d, "", name), i * 2 + 1, size, d->nedge);
+	d->sep = ",";
+}
+
+static void jsH_write(js_State *J, jsH_Dump *d)
+{
+	FILE *f = d->f;
+	jsH_Node *n;
+	js_Object *obj;
+	js_Function *fun;
+	int i, type, nedge;
+
+	/* count the edges first, for the header and each node */
+	d->count = 1;
+	jsH_roots(J, d);
+	for (i = 0; i < d->nnode; ++i)
+		jsH_edges(J, d, &d->node[i]);
+	nedge = d->nedge;
+
+	fprintf(f, "{\"snapshot\":{\"meta\":{");
+	fprintf(f, "\"node_fields\":[\"type\",\"name\",\"id\",\"self_size\",\"edge_count\",\"trace_node_id\"],\n");
+	fprintf(f, "\"node_types\":[[\"hidden\",\"array\",\"string\",\"object\",\"code\",\"closure\",\"regexp\",\"number\",\"native\",\"synthetic\"],");
+	fprintf(f, "\"string\",\"number\",\"number\",\"number\",\"number\"],\n");
+	fprintf(f, "\"edge_fields\":[\"type\",\"name_or_index\",\"to_node\"],\n");
+	fprintf(f, "\"edge_types\":[[\"context\",\"element\",\"property\",\"internal\",\"hidden\",\"shortcut\",\"weak\"],");
+	fprintf(f, "\"string_or_number\",\"node\"],\n");
+	fprintf(f, "\"trace_function_info_fields\":[],\"trace_node_fields\":[],\"sample_fields\":[],\"location_fields\":[]},\n");
+	fprintf(f, "\"node_count\":%d,\"edge_count\":%d,\"trace_function_count\":0},\n", d->nnode + 1, nedge);
+
+	fprintf(f, "\"nodes\":[");
+	d->sep = "";
+	d->nedge = 0;
+	jsH_roots(J, d);
+	jsH_writenode(J, d, 0, H_SYNTHETIC, "(GC roots)", 0);
+	for (i = 0; i < d->nnode; ++i) {
+		n = &d->node[i];
+		d->nedge = 0;
+		jsH_edges(J, d, n);
+		switch (n->kind) {
+		case H_HIDDEN:
+			jsH_writenode(J, d, i + 1, H_HIDDEN, "(environment)", JS_POOLSIZE(sizeof (js_Env)));
+			break;
+		case H_CODE:
+			fun = (js_Function *)n->ptr;
+			jsH_writenode(J, d, i + 1, H_CODE, fun->name, jsG_functionsize(fun));
+			break;
+		case H_STRING:
+			jsH_writenode(J, d, i + 1, H_STRING, ((js_String *)n->ptr)->p, jsG_stringsize((js_String *)n->ptr));
+			break;
+		case H_OBJECT:
+			obj = (js_Object *)n->ptr;
+			switch (obj->type) {
+			case JS_CARRAY: type = H_ARRAY; break;
+			case JS_CFUNCTION: case JS_CSCRIPT: case JS_CCFUNCTION: type = H_CLOSURE; break;
+			case JS_CREGEXP: type = H_REGEXP; break;
+			case JS_CUSERDATA: type = H_NATIVE; break;
+			default: type = H_OBJECT; break;
+			}
+			jsH_writenode(J, d, i + 1, type, jsH_objectname(obj),
+				jsG_objectsize(obj) + obj->count * JS_POOLSIZE(sizeof (js_Property)));
+			break;
+		}
+	}
+	fprintf(f, "],\n");
+
+	fprintf(f, "\"edges\":[");
+	d->count = 0;
+	d->sep = "";
+	jsH_roots(J, d);
+	for (i = 0; i < d->nnode; ++i)
+		jsH_edges(J, d, &d->node[i]);
+	fprintf(f, "],\n");
+
+	fprintf(f, "\"trace_function_infos\":[],\"trace_tree\":[],\"samples\":[],\"locations\":[],\n");
+	fprintf(f, "\"strings\":[");
+	for (i = 0; i < d->nstr; ++i) {
+		fprintf(f, "%s\"", i > 0 ? "," : "");
+		jsH_putstring(f, d->str[i].prefix);
+		jsH_putstring(f, d->str[i].s ? d->str[i].s : "");
+		fprintf(f, "\"\n");
+	}
+	fprintf(f, "]}\n");
+}
+
+void js_dumpheap(js_State *J, const char *filename)
+{
+	jsH_Dump d;
+	js_Env *env;
+	js_Function *fun;
+	js_Object *obj;
+	js_String *str;
+	int n = 0;
+
+	/* only live nodes are left on the lists after a full collection */
+	js_gc(J, 0);
+
+	for (env = J->gcenv; env; env = env->gcnext) ++n;
+	for (fun = J->gcfun; fun; fun = fun->gcnext) ++n;
+	for (obj = J->gcobj; obj; obj = obj->gcnext) ++n;
+	for (str = J->gcstr; str; str = str->gcnext) ++n;
+
+	memset(&d, 0, sizeof d);
+	d.node = js_malloc(J, (n > 0 ? n : 1) * sizeof *d.node);
+	d.f = fopen(filename, "wb");
+	if (!d.f) {
+		js_free(J, d.node);
+		js_error(J, "cannot open file: '%s'", filename);
+	}
+
+	if (js_try(J)) {
+		fclose(d.f);
+		js_free(J, d.node);
+		js_free(J, d.str);
+		js_throw(J);
+	}
+
+	for (env = J->gcenv; env; env = env->gcnext)
+		d.node[d.nnode].ptr = env, d.node[d.nnode++].kind = H_HIDDEN;
+	for (fun = J->gcfun; fun; fun = fun->gcnext)
+		d.node[d.nnode].ptr = fun, d.node[d.nnode++].kind = H_CODE;
+	for (obj = J->gcobj; obj; obj = obj->gcnext)
+		d.node[d.nnode].ptr = obj, d.node[d.nnode++].kind = H_OBJECT;
+	for (str = J->gcstr; str; str = str->gcnext)
+		d.node[d.nnode].ptr = str, d.node[d.nnode++].kind = H_STRING;
+	qsort(d.node, d.nnode, sizeof *d.node, jsH_cmp);
+
+	jsH_write(J, &d);
+	if (ferror(d.f))
+		js_error(J, "cannot write file: '%s'", filename);
+
+	js_endtry(J);
+	js_free(J, d.node);
+	js_free(J, d.str);
+	if (fclose(d.f))
+		js_error(J, "cannot write file: '%s'", filename);
+}
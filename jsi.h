@@ -52,9 +52,14 @@ static __inline int signbit(double x) {union{double d;__int64 i;}u;u.d=x;return
 #define soffsetof(x,y) ((int)offsetof(x,y))
 #define nelem(a) (int)(sizeof (a) / sizeof (a)[0])
 
+void *js_countalloc(void *actx, void *ptr, int size);
 void *js_malloc(js_State *J, int size);
 void *js_realloc(js_State *J, void *ptr, int size);
 void  js_free(js_State *J, void *ptr);
+void  js_freeblock(js_Alloc alloc, void *actx, void *ptr);
+void *js_poolalloc(js_State *J, int size);
+void  js_poolfree(js_State *J, void *ptr, int size);
+int   js_blocksize(void *ptr);
 
 typedef struct js_Regexp js_Regexp;
 typedef struct js_Value  js_Value;
@@ -64,16 +69,39 @@ typedef struct js_Ast    js_Ast;
 typedef struct js_Function js_Function;
 typedef struct js_Environment js_Env;
 typedef struct js_StringNode  js_StringNode;
+typedef struct js_Shared      js_Shared;
+typedef struct js_CodeEntry   js_CodeEntry;
+typedef struct js_Source      js_Source;
 typedef struct js_Jumpbuf     js_Jumpbuf;
 typedef struct js_StackTrace  js_StackTrace;
 
+struct Resub; /* regexp.h */
+
 /* Limits */
 
 #define JS_STACKSIZE 256	/* value stack size */
 #define JS_ENVLIMIT 64		/* environment stack size */
 #define JS_TRYLIMIT 64		/* exception stack size */
-#define JS_GCLIMIT 10000	/* run gc cycle every N allocations */
+#define JS_GCGROWTH 200		/* collect when the heap has grown to N% of its size after the last gc */
+#define JS_GCHEAPMIN 1024	/* ... but not before it reaches N kilobytes */
+#define JS_GCYOUNG 1024		/* kilobytes allocated between minor gc collections */
+#define JS_GCSTEP 64		/* kilobytes allocated between incremental gc steps */
+#define JS_GCWORK 128		/* incremental gc work units per kilobyte */
+#define JS_GCWORKMIN 32		/* ... and the least allowed, below which marking falls behind */
+#define JS_GRAYLIMIT (1<<20)	/* gc mark stack size before falling back to rescanning */
+#define JS_MEMRESERVE 64	/* kilobytes past the memory limit left to handle an out of memory error */
+#define JS_MEMRETRY 16		/* full collections at the next safe points after a block is refused */
+#define JS_POOLPAGE 16384	/* bytes fetched from the allocator to carve into small blocks */
+#define JS_POOLQUANTUM 16	/* small block sizes are multiples of this */
+#define JS_POOLMAX 256		/* largest block served from the pools */
+#define JS_POOLSIZE(n) (((n) + JS_POOLQUANTUM - 1) / JS_POOLQUANTUM * JS_POOLQUANTUM)
 #define JS_ASTLIMIT 100		/* max nested expressions */
+#define JS_ASTPAGE 16384	/* bytes fetched at a time for syntax tree nodes */
+#define JS_STREAMBUF 65536	/* initial buffer for a script read from a stream */
+#define JS_LEXCACHE 1024	/* recently interned names remembered by the lexer */
+#define JS_CONSTSCAN 256	/* latest constants of a function searched for a duplicate before adding one */
+#define JS_CODECACHE 64		/* compiled scripts and functions kept for reuse */
+#define JS_CODETEXT (1<<18)	/* longest source text kept in the code cache */
 
 /* instruction size -- change to int if you get integer overflow syntax errors */
 typedef unsigned short js_Instruction;
@@ -82,6 +110,9 @@ typedef unsigned short js_Instruction;
 
 char       *js_strdup(js_State *J, const char *s);
 const char *js_intern(js_State *J, const char *s);
+void jn_memstats(js_State *J, js_MemStats *stats);
+void jn_freeze(js_State *J, js_Shared *S);
+void jn_freeshared(js_Shared *S);
 void        js_dumpss(js_State *J);
 void        js_freess(js_State *J);
 
@@ -91,6 +122,49 @@ void   js_fmtexp(char *p, int e);
 int    js_grisu2(double v, char *buffer, int *K);
 double js_strtod(const char *as, char **aas);
 
+/* Garbage collector */
+
+enum { JS_GCIDLE, JS_GCMARK, JS_GCSWEEP };
+
+/* new allocations are white while marking, and live while sweeping */
+#define JS_GCNEWMARK(J) ((J)->gcstate == JS_GCSWEEP ? (J)->gcmark : 0)
+
+void jsG_step(js_State *J);
+void jsG_sweepall(js_State *J);
+void jsG_freeze(js_State *J);
+void jsG_retain(js_Shared *S);
+void jsG_release(js_Shared *S);
+void jsG_holdmodule(js_State *J, js_Shared *S);
+void jsS_restore(js_State *J, const void *data, int size);
+void jsX_clone(js_State *K, js_State *J);
+
+/*
+	Functions and interned strings of a state that has been cloned, or
+	of a compiled module. They are frozen: never marked, swept or changed
+	again, so every state holding them can use them, on any thread. Each
+	state holds one reference to its newest cloned block, which holds one
+	on its parent, and one on each module it has loaded. A block is freed
+	with the allocator of the state that made it.
+*/
+
+struct js_Shared
+{
+	int refs;
+	js_Alloc alloc;
+	void *actx;
+	js_Shared *parent;
+	js_Function *fun; /* linked by gcnext */
+	js_StringNode *strings;
+};
+
+struct js_Module
+{
+	js_Shared *shared;
+	js_Function *main;
+};
+
+js_State *js_newstatex(js_Alloc alloc, void *actx);
+
 /* Private stack functions */
 
 void js_new_function(js_State *J, js_Function *function, js_Env *scope);
@@ -99,6 +173,7 @@ void js_new_script(js_State *J, js_Function *function, js_Env *scope);
 
 void js_new_cfunc(js_State *J, js_CFunction fun, const char *name, int len);
 void js_new_cctor(js_State *J, js_CFunction fun, js_CFunction con, const char *name, int len);
+void js_newerror_range(js_State *J, const char *message);
 
 js_Regexp *js_toregexp(js_State *J, int idx);
 int js_is_arr_index(js_State *J, const char *str, int *idx);
@@ -116,7 +191,8 @@ void js_rot3pop2(js_State *J);
 void js_dup1rot3(js_State *J);
 void js_dup1rot4(js_State *J);
 
-void js_RegExp_prototype_exec(js_State *J, js_Regexp *re, const char *text);
+int  js_regexp_exec(js_State *J, js_Regexp *re, int idx, struct Resub *m, int *index);
+void js_RegExp_prototype_exec(js_State *J, js_Regexp *re, int idx);
 
 void js_trap(js_State *J, int pc); /* dump stack and environment to stdout */
 
@@ -164,16 +240,30 @@ struct js_State
 	js_Alloc  alloc;
 	js_Report report;
 	js_Panic  panic;
+	js_Notify finalize; /* told when userdata finalizers are pending */
 
 	js_StringNode *strings;
+	js_Shared *shared; /* frozen functions and strings shared with clones */
+	js_Shared **modules; /* blocks of the modules loaded */
+	int nmodules, modulecap;
+
+	/* compiled code cache, see jscache.c */
+	js_CodeEntry **codetab;
+	js_CodeEntry *codelru; /* most recently used first */
+	int codecount, codecap, codemax;
 
 	int default_strict;
 	int strict;
+	int lazycompile;
 
 	/* parser input source */
 	const char *filename;
 	const char *source;
 	int line;
+	js_Read streamread; /* reads more of the source, if it comes from a stream */
+	void *streamdata;
+	char *streambuf, *streamend; /* text read so far, from the start of the current token */
+	int streamcap, streameof;
 
 	/* lexer state */
 	struct { char *text; int len, cap; } lexbuf;
@@ -181,6 +271,8 @@ struct js_State
 	int lexchar;
 	int lasttoken;
 	int newline;
+	const char *lexstart; /* where the last token began, if it is ASCII */
+	const char **lexcache; /* interned names and strings, by a hash of their text */
 
 	/* parser state */
 	int astdepth;
@@ -188,7 +280,15 @@ struct js_State
 	int lookahead;
 	const char *text;
 	double number;
-	js_Ast *gcast; /* list of allocated nodes to free after parsing */
+	void *astpage; /* newest page of syntax tree nodes; its first quantum links to the one before */
+	char *astnext, *astend; /* free space left in it */
+	const char *astsource; /* start of the text being parsed */
+	const char *funstart; /* where the last 'function' keyword began */
+	int funline;
+	int lazyparse; /* only check the syntax of inner function bodies */
+
+	/* compiler state */
+	js_Source *lazysource; /* copy of the source text for inner functions compiled later */
 
 	/* runtime environment */
 	js_Object *Object_prototype;
@@ -207,6 +307,7 @@ struct js_State
 	js_Object *SyntaxError_prototype;
 	js_Object *TypeError_prototype;
 	js_Object *URIError_prototype;
+	int lazy; /* builtin libraries not created yet, see jb_lazyinit */
 
 	int nextref; /* for js_ref use */
 	js_Object *R; /* registry of hidden values */
@@ -218,13 +319,44 @@ struct js_State
 	int top, bot;
 	js_Value *stack;
 
+	/* free lists of small blocks, one per size class */
+	void *pool[JS_POOLMAX / JS_POOLQUANTUM];
+	void *poolpages;
+
 	/* garbage collector list */
 	int gcmark;
-	int gccounter;
+	size_t gcbytes; /* bytes allocated through js_malloc */
+	size_t gclimit; /* collect or take a step when gcbytes passes this */
+	size_t gcmajor; /* start a full collection when gcbytes passes this */
+	int gcpause, gcminheap, gcnursery;
+	size_t memlimit; /* allocations past this many bytes throw, if set */
+	int memfault; /* 1 when the limit refused a block, 2 while its error is handled */
+	int gcurgent; /* full collections still owed after a refused block */
+	size_t gcneed; /* size of the refused block; a collection freeing as much settles the debt */
 	js_Env      *gcenv;
 	js_Function *gcfun;
 	js_Object   *gcobj;
 	js_String   *gcstr;
+	js_Object   *gcfinal; /* dead userdata waiting for its finalizer */
+
+	/* incremental collector state */
+	int gcstate;
+	int gcincremental, gcstepsize, gcstepmul;
+	int gcgenerational;
+	int gcminor; /* the sweep in progress stops at the old nodes */
+	int gcsweeps; /* sweeps started; strings cached across one may be gone */
+	struct { js_Object **stack; int top, cap, overflow; } gcgray;
+	js_Env      **gcsweepenv;
+	js_Function **gcsweepfun;
+	js_Object   **gcsweepobj;
+	js_String   **gcsweepstr;
+	js_Env      *gcoldenv; /* first node that survived the last collection */
+	js_Function *gcoldfun;
+	js_Object   *gcoldobj;
+	js_String   *gcoldstr;
+	int gcnenv, gcnfun, gcnobj, gcnstr; /* swept in this cycle */
+	js_GCStats gcstats;
+	int gcgenv, gcgfun, gcgobj, gcgstr; /* freed in this cycle */
 
 	/* environments on the call stack but currently not in scope */
 	int envtop;
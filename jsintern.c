@@ -2,31 +2,51 @@
 
 /* Dynamically grown string buffer */
 
-void js_putc(js_State *J, js_Buffer **sbp, int c)
+static js_Buffer *js_putgrow(js_State *J, js_Buffer **sbp, int n)
 {
 	js_Buffer *sb = *sbp;
+	int m;
 	if (!sb) {
-		sb = js_malloc(J, sizeof *sb);
+		m = sizeof sb->s;
+		while (m < n)
+			m *= 2;
+		sb = js_malloc(J, m + soffsetof(js_Buffer, s));
 		sb->n = 0;
-		sb->m = sizeof sb->s;
+		sb->m = m;
 		*sbp = sb;
-	} else if (sb->n == sb->m) {
-		sb = js_realloc(J, sb, (sb->m *= 2) + soffsetof(js_Buffer, s));
+	} else if (sb->n + n > sb->m) {
+		m = sb->m;
+		while (m < sb->n + n)
+			m *= 2;
+		sb = js_realloc(J, sb, m + soffsetof(js_Buffer, s));
+		sb->m = m;
 		*sbp = sb;
 	}
+	return sb;
+}
+
+void js_putc(js_State *J, js_Buffer **sbp, int c)
+{
+	js_Buffer *sb = *sbp;
+	if (!sb || sb->n == sb->m)
+		sb = js_putgrow(J, sbp, 1);
 	sb->s[sb->n++] = c;
 }
 
 void js_puts(js_State *J, js_Buffer **sb, const char *s)
 {
-	while (*s)
-		js_putc(J, sb, *s++);
+	js_putm(J, sb, s, s + strlen(s));
 }
 
-void js_putm(js_State *J, js_Buffer **sb, const char *s, const char *e)
+void js_putm(js_State *J, js_Buffer **sbp, const char *s, const char *e)
 {
-	while (s < e)
-		js_putc(J, sb, *s++);
+	js_Buffer *sb;
+	int n = e - s;
+	if (n <= 0)
+		return;
+	sb = js_putgrow(J, sbp, n);
+	memcpy(sb->s + sb->n, s, n);
+	sb->n += n;
 }
 
 /* Use an AA-tree to quickly look up interned strings. */
@@ -123,15 +143,68 @@ static void jn_free_str_node(js_State *J, js_StringNode *node)
 	js_free(J, node);
 }
 
+static void jn_memstats_node(js_StringNode *node, js_MemStats *stats)
+{
+	while (CHECK_STR_NODE(node)) {
+		++stats->interned;
+		stats->internbytes += js_blocksize(node);
+		jn_memstats_node(node->left, stats);
+		node = node->right;
+	}
+}
+
+void jn_memstats(js_State *J, js_MemStats *stats)
+{
+	jn_memstats_node(J->strings, stats);
+}
+
 void jn_free_strings(js_State *J)
 {
 	if (CHECK_STR_NODE(J->strings))
 		jn_free_str_node(J, J->strings);
 }
 
+/* Hand the interned strings to a shared block; the state no longer counts them. */
+void jn_freeze(js_State *J, js_Shared *S)
+{
+	js_MemStats stats;
+	memset(&stats, 0, sizeof stats);
+	jn_memstats_node(J->strings, &stats);
+	J->gcbytes -= stats.internbytes;
+	S->strings = J->strings;
+	J->strings = NULL;
+}
+
+static void jn_free_shared_node(js_Shared *S, js_StringNode *node)
+{
+	if (CHECK_STR_NODE(node->left))
+		jn_free_shared_node(S, node->left);
+	if (CHECK_STR_NODE(node->right))
+		jn_free_shared_node(S, node->right);
+	js_freeblock(S->alloc, S->actx, node);
+}
+
+void jn_freeshared(js_Shared *S)
+{
+	if (CHECK_STR_NODE(S->strings))
+		jn_free_shared_node(S, S->strings);
+}
+
 const char *js_intern(js_State *J, const char *s)
 {
 	const char *result;
+	js_Shared *S;
+	js_StringNode *node;
+	int c;
+	for (S = J->shared; S; S = S->parent) {
+		node = S->strings;
+		while (CHECK_STR_NODE(node)) {
+			c = strcmp(s, node->string);
+			if (c == 0)
+				return node->string;
+			node = c < 0 ? node->left : node->right;
+		}
+	}
 	if (!J->strings)
 		 J->strings = &jstr_null;
 	J->strings = jn_insert(J, J->strings, s, &result);
@@ -96,14 +96,75 @@ int jsY_findword(const char *s, const char **list, int num)
 	return -1;
 }
 
-static int jsY_findkeyword(js_State *J, const char *s)
+/*
+	The lexer remembers the strings it interned in a table indexed by a
+	hash of their text, so a name that is used again skips the walk down
+	the interned string tree. Interned strings live as long as the state.
+*/
+static const char *jsY_intern(js_State *J, const char *s, int n)
+{
+	unsigned int h = 2166136261U;
+	const char **slot;
+	int i, nul = 0;
+
+	for (i = 0; i < n; ++i) {
+		h = (h ^ (unsigned char)s[i]) * 16777619;
+		nul |= !s[i];
+	}
+
+	/* a string with a NUL is interned short, so it cannot be compared by its text */
+	if (nul) {
+		slot = NULL;
+		goto miss;
+	}
+
+	if (!J->lexcache) {
+		J->lexcache = js_malloc(J, JS_LEXCACHE * sizeof *J->lexcache);
+		memset(J->lexcache, 0, JS_LEXCACHE * sizeof *J->lexcache);
+	}
+	slot = &J->lexcache[h & (JS_LEXCACHE - 1)];
+	if (*slot && !strncmp(*slot, s, n) && (*slot)[n] == 0)
+		return *slot;
+
+miss:
+	/* js_intern wants a terminated string */
+	if (s != J->lexbuf.text) {
+		if (n + 1 > J->lexbuf.cap) {
+			J->lexbuf.text = js_realloc(J, J->lexbuf.text, n + 1);
+			J->lexbuf.cap = n + 1;
+		}
+		memcpy(J->lexbuf.text, s, n);
+		J->lexbuf.len = n;
+	}
+	J->lexbuf.text[n] = 0;
+	if (!slot)
+		return js_intern(J, J->lexbuf.text);
+	return *slot = js_intern(J, J->lexbuf.text);
+}
+
+/*
+	Perfect hash of the keywords, on their first two letters and length.
+	Each slot holds the index in keywords[] of the one that lands there.
+*/
+#define KWHASH(s, n) (((unsigned char)(s)[0] + (unsigned char)(s)[1] * 13 + (n) * 22) & 63)
+
+static const signed char kwtab[64] = {
+	23, 9, 19, 13, -1, -1, -1, 12, -1, 6, -1, 11, -1, -1, -1, -1,
+	-1, 16, -1, -1, 20, 10, 22, 18, -1, -1, 0, 15, -1, 24, -1, 5,
+	-1, -1, -1, -1, 28, 25, -1, -1, 1, -1, 21, 14, -1, 27, -1, -1,
+	-1, 26, -1, 7, -1, 4, 3, 17, -1, 8, -1, -1, -1, -1, 2, -1,
+};
+
+static int jsY_findkeyword(js_State *J, const char *s, int n)
 {
-	int i = jsY_findword(s, keywords, nelem(keywords));
-	if (i >= 0) {
-		J->text = keywords[i];
-		return TK_BREAK + i; /* first keyword + i */
+	if (n >= 2 && n <= 10) {
+		int i = kwtab[KWHASH(s, n)];
+		if (i >= 0 && !strncmp(s, keywords[i], n) && keywords[i][n] == 0) {
+			J->text = keywords[i];
+			return TK_BREAK + i; /* first keyword + i */
+		}
 	}
-	J->text = js_intern(J, s);
+	J->text = jsY_intern(J, s, n);
 	return TK_IDENTIFIER;
 }
 
@@ -131,6 +192,8 @@ static int jsY_isidentifierpart(int c)
 	return isdigit(c) || isalpha(c) || c == '$' || c == '_' || isalpharune(c);
 }
 
+#define isasciipart(c) ((unsigned char)(c) < Runeself && (isdigit((unsigned char)(c)) || isalpha((unsigned char)(c)) || (c) == '$' || (c) == '_'))
+
 static int jsY_isdec(int c)
 {
 	return isdigit(c);
@@ -149,10 +212,50 @@ int jsY_tohex(int c)
 	return 0;
 }
 
+/*
+	A script read from a stream is lexed from a buffer that is topped up
+	as it runs low. The text of the current token is moved to the front
+	and kept, so the number lexer can convert it in place.
+*/
+static void jsY_fill(js_State *J)
+{
+	int pos = J->source - J->lexstart;
+	int len = J->streamend - J->lexstart;
+	int n;
+
+	if (J->streameof)
+		return;
+
+	memmove(J->streambuf, J->lexstart, len);
+	while (!J->streameof && len - pos <= UTFmax) {
+		if (len >= J->streamcap / 2) {
+			J->streambuf = js_realloc(J, J->streambuf, J->streamcap * 2);
+			J->streamcap *= 2;
+		}
+		n = J->streamread(J->streamdata, J->streambuf + len, J->streamcap - len - 1);
+		if (n < 0)
+			js_error(J, "cannot read data from file: '%s'", J->filename);
+		if (n == 0)
+			J->streameof = 1;
+		len += n;
+	}
+
+	J->streambuf[len] = 0;
+	J->lexstart = J->streambuf;
+	J->source = J->streambuf + pos;
+	J->streamend = J->streambuf + len;
+}
+
 static void jsY_next(js_State *J)
 {
 	Rune c;
-	J->source += chartorune(&c, J->source);
+	if (J->streamread && J->streamend - J->source <= UTFmax)
+		jsY_fill(J);
+	c = *(const unsigned char *)J->source;
+	if (c < Runeself)
+		++J->source;
+	else
+		J->source += chartorune(&c, J->source);
 	/* consume CR LF as one unit */
 	if (c == '\r' && *J->source == '\n')
 		++J->source;
@@ -193,14 +296,23 @@ static void textinit(js_State *J)
 	J->lexbuf.len = 0;
 }
 
-static void textpush(js_State *J, Rune c)
+static void textpushm(js_State *J, const char *s, int n)
 {
-	int n = runelen(c);
-	if (J->lexbuf.len + n > J->lexbuf.cap) {
+	while (J->lexbuf.len + n > J->lexbuf.cap) {
 		J->lexbuf.cap = J->lexbuf.cap * 2;
 		J->lexbuf.text = js_realloc(J, J->lexbuf.text, J->lexbuf.cap);
 	}
-	J->lexbuf.len += runetochar(J->lexbuf.text + J->lexbuf.len, &c);
+	memcpy(J->lexbuf.text + J->lexbuf.len, s, n);
+	J->lexbuf.len += n;
+}
+
+static void textpush(js_State *J, Rune c)
+{
+	char buf[UTFmax];
+	if (c < Runeself && J->lexbuf.len < J->lexbuf.cap)
+		J->lexbuf.text[J->lexbuf.len++] = c;
+	else
+		textpushm(J, buf, runetochar(buf, &c));
 }
 
 static char *textend(js_State *J)
@@ -323,8 +435,6 @@ static int lexnumber(js_State *J)
 
 static int lexnumber(js_State *J)
 {
-	const char *s = J->source - 1;
-
 	if (jsY_accept(J, '0')) {
 		if (jsY_accept(J, 'x') || jsY_accept(J, 'X')) {
 			J->number = lexhex(J);
@@ -363,7 +473,7 @@ static int lexnumber(js_State *J)
 	if (jsY_isidentifierstart(J->lexchar))
 		jsY_error(J, "number with letter suffix");
 
-	J->number = js_strtod(s, NULL);
+	J->number = js_strtod(J->lexstart, NULL);
 	return TK_NUMBER;
 }
 
@@ -411,8 +521,6 @@ static int lexescape(js_State *J)
 
 static int lexstring(js_State *J)
 {
-	const char *s;
-
 	int q = J->lexchar;
 	jsY_next(J);
 
@@ -425,15 +533,21 @@ static int lexstring(js_State *J)
 			if (lexescape(J))
 				jsY_error(J, "malformed escape sequence");
 		} else {
+			/* copy a run of plain ASCII in one go */
+			const char *p = J->source;
 			textpush(J, J->lexchar);
+			while (*p >= 0x20 && *p < 0x7F && *p != q && *p != '\\')
+				++p;
+			textpushm(J, J->source, p - J->source);
+			J->source = p;
 			jsY_next(J);
 		}
 	}
 	jsY_expect(J, q);
 
-	s = textend(J);
+	textend(J);
 
-	J->text = js_intern(J, s);
+	J->text = jsY_intern(J, J->lexbuf.text, J->lexbuf.len - 1);
 	return TK_STRING;
 }
 
@@ -538,6 +652,7 @@ static int jsY_lexx(js_State *J)
 
 		while (jsY_iswhite(J->lexchar))
 			jsY_next(J);
+		J->lexstart = J->source - 1;
 
 		if (jsY_accept(J, '\n')) {
 			J->newline = 1;
@@ -686,6 +801,21 @@ static int jsY_lexx(js_State *J)
 			return 0; /* EOF */
 		}
 
+		/* Plain ASCII names are taken straight from the source */
+		if (J->lexchar < Runeself && jsY_isidentifierstart(J->lexchar)) {
+			const char *s = J->source - 1;
+			const char *p = J->source;
+			while (isasciipart(*p))
+				++p;
+			/* stop at the end of a stream buffer too, and take the slow path */
+			if (*(const unsigned char *)p < Runeself && *p != '\\' && (*p || !J->streamread)) {
+				int tok = jsY_findkeyword(J, s, p - s);
+				J->source = p;
+				jsY_next(J);
+				return tok;
+			}
+		}
+
 		/* Handle \uXXXX escapes in identifiers */
 		jsY_unescape(J);
 		if (jsY_isidentifierstart(J->lexchar)) {
@@ -702,7 +832,7 @@ static int jsY_lexx(js_State *J)
 
 			textend(J);
 
-			return jsY_findkeyword(J, J->lexbuf.text);
+			return jsY_findkeyword(J, J->lexbuf.text, J->lexbuf.len - 1);
 		}
 
 		if (J->lexchar >= 0x20 && J->lexchar <= 0x7E)
@@ -720,6 +850,29 @@ void jsY_initlex(js_State *J, const char *filename, const char *source)
 	jsY_next(J); /* load first lookahead character */
 }
 
+void jsY_initstream(js_State *J, const char *filename, js_Read read, void *data)
+{
+	J->streambuf = js_malloc(J, JS_STREAMBUF);
+	J->streambuf[0] = 0;
+	J->streamend = J->streambuf;
+	J->streamcap = JS_STREAMBUF;
+	J->streameof = 0;
+	J->streamread = read;
+	J->streamdata = data;
+	J->filename = filename;
+	J->source = J->lexstart = J->streambuf;
+	J->line = 1;
+	J->lasttoken = 0;
+	jsY_next(J); /* load first lookahead character */
+}
+
+void jsY_freestream(js_State *J)
+{
+	js_free(J, J->streambuf);
+	J->streambuf = J->streamend = NULL;
+	J->streamread = NULL;
+}
+
 int jsY_lex(js_State *J)
 {
 	return J->lasttoken = jsY_lexx(J);
@@ -75,6 +75,8 @@ const char *jsY_tokenstring(int token);
 int jsY_findword(const char *s, const char **list, int num);
 
 void jsY_initlex(js_State *J, const char *filename, const char *source);
+void jsY_initstream(js_State *J, const char *filename, js_Read read, void *data);
+void jsY_freestream(js_State *J);
 int jsY_lex(js_State *J);
 int jsY_lexjson(js_State *J);
 
@@ -115,19 +115,19 @@ static void O_getOwnPropertyDescriptor(js_State *J)
 		js_push_undef(J);
 	else {
 		js_new_object(J);
-		if (!ref->getter && !ref->setter) {
-			js_push_value(J, ref->value);
+		if (!(ref->atts & JS_ACCESSOR)) {
+			js_push_value(J, ref->u.value);
 			js_set_prop(J, -2, "value");
 			js_push_bool(J, !(ref->atts & JS_READONLY));
 			js_set_prop(J, -2, "writable");
 		} else {
-			if (ref->getter)
-				js_push_object(J, ref->getter);
+			if (ref->u.acc.getter)
+				js_push_object(J, ref->u.acc.getter);
 			else
 				js_push_undef(J);
 			js_set_prop(J, -2, "get");
-			if (ref->setter)
-				js_push_object(J, ref->setter);
+			if (ref->u.acc.setter)
+				js_push_object(J, ref->u.acc.setter);
 			else
 				js_push_undef(J);
 			js_set_prop(J, -2, "set");
@@ -161,6 +161,7 @@ static void O_getOwnPropertyNames(js_State *J)
 
 	js_new_array(J);
 
+	jp_materialize(J, obj);
 	if (obj->properties->level)
 		i = O_getOwnPropertyNames_walk(J, obj->properties, 0);
 	else
@@ -261,7 +262,10 @@ static void O_defineProperties_walk(js_State *J, js_Property *ref)
 	if (ref->left->level)
 		O_defineProperties_walk(J, ref->left);
 	if (!(ref->atts & JS_DONTENUM)) {
-		js_push_value(J, ref->value);
+		if (ref->atts & JS_ACCESSOR)
+			js_get_prop(J, 2, ref->name);
+		else
+			js_push_value(J, ref->u.value);
 		ToPropertyDescriptor(J, js_toobject(J, 1), ref->name, js_toobject(J, -1));
 		js_pop(J, 1);
 	}
@@ -277,6 +281,7 @@ static void O_defineProperties(js_State *J)
 	JS_CHECK_OBJ(J, 2) ;
 
 	props = js_toobject(J, 2);
+	jp_materialize(J, props);
 	if (props->properties->level)
 		O_defineProperties_walk(J, props->properties);
 
@@ -288,9 +293,14 @@ static void O_create_walk(js_State *J, js_Object *obj, js_Property *ref)
 	if (ref->left->level)
 		O_create_walk(J, obj, ref->left);
 	if (!(ref->atts & JS_DONTENUM)) {
-		if (ref->value.type != JS_TOBJECT)
+		if (ref->atts & JS_ACCESSOR)
+			js_get_prop(J, 2, ref->name);
+		else
+			js_push_value(J, ref->u.value);
+		if (!js_is_object(J, -1))
 			js_error_type(J, "not an object");
-		ToPropertyDescriptor(J, obj, ref->name, ref->value.u.object);
+		ToPropertyDescriptor(J, obj, ref->name, js_toobject(J, -1));
+		js_pop(J, 1);
 	}
 	if (ref->right->level)
 		O_create_walk(J, obj, ref->right);
@@ -317,6 +327,7 @@ static void O_create(js_State *J)
 		JS_CHECK_OBJ(J, 2);
 
 		props = js_toobject(J, 2);
+		jp_materialize(J, props);
 		if (props->properties->level)
 			O_create_walk(J, obj, props->properties);
 	}
@@ -345,6 +356,7 @@ static void O_keys(js_State *J)
 
 	js_new_array(J);
 
+	jp_materialize(J, obj);
 	if (obj->properties->level)
 		i = O_keys_walk(J, obj->properties, 0);
 	else
@@ -389,6 +401,7 @@ static void O_seal(js_State *J)
 	obj = js_toobject(J, 1);
 	obj->extensible = 0;
 
+	jp_materialize(J, obj);
 	if (obj->properties->level)
 		O_seal_walk(J, obj->properties);
 
@@ -420,6 +433,7 @@ static void O_isSealed(js_State *J)
 		return;
 	}
 
+	jp_materialize(J, obj);
 	if (obj->properties->level)
 		js_push_bool(J, O_isSealed_walk(J, obj->properties));
 	else
@@ -444,6 +458,7 @@ static void O_freeze(js_State *J)
 	obj = js_toobject(J, 1);
 	obj->extensible = 0;
 
+	jp_materialize(J, obj);
 	if (obj->properties->level)
 		O_freeze_walk(J, obj->properties);
 
@@ -475,6 +490,7 @@ static void O_isFrozen(js_State *J)
 		return;
 	}
 
+	jp_materialize(J, obj);
 	if (obj->properties->level)
 		js_push_bool(J, O_isFrozen_walk(J, obj->properties));
 	else
@@ -59,9 +59,43 @@ static void jsP_warning(js_State *J, const char *fmt, ...)
 	js_report(J, buf);
 }
 
+/*
+	Syntax tree nodes, and the jump lists the compiler hangs on them, are
+	carved from pages that are all thrown away at once when the parse is
+	done. Nothing is freed one node at a time.
+*/
+void *jsP_alloc(js_State *J, int size)
+{
+	char *p;
+	size = JS_POOLSIZE(size);
+	if (size > J->astend - J->astnext) {
+		int n = JS_POOLQUANTUM + size > JS_ASTPAGE ? JS_POOLQUANTUM + size : JS_ASTPAGE;
+		char *page = js_malloc(J, n);
+		*(void**)page = J->astpage;
+		J->astpage = page;
+		J->astnext = page + JS_POOLQUANTUM;
+		J->astend = page + n;
+	}
+	p = J->astnext;
+	J->astnext += size;
+	return p;
+}
+
+/* Free what was allocated since the page and position were taken */
+static void jsP_release(js_State *J, void *page, char *next)
+{
+	while (J->astpage != page) {
+		void *prev = *(void**)J->astpage;
+		js_free(J, J->astpage);
+		J->astpage = prev;
+	}
+	J->astnext = next;
+	J->astend = page ? (char*)page + js_blocksize(page) : NULL;
+}
+
 static js_Ast *jsP_newnode(js_State *J, enum js_AstType type, js_Ast *a, js_Ast *b, js_Ast *c, js_Ast *d)
 {
-	js_Ast *node = js_malloc(J, sizeof *node);
+	js_Ast *node = jsP_alloc(J, sizeof *node);
 
 	node->type = type;
 	node->line = J->astline;
@@ -73,6 +107,8 @@ static js_Ast *jsP_newnode(js_State *J, enum js_AstType type, js_Ast *a, js_Ast
 	node->string = NULL;
 	node->jumps = NULL;
 	node->casejump = 0;
+	node->source = NULL;
+	node->sourceline = 0;
 
 	node->parent = NULL;
 	if (a) a->parent = node;
@@ -80,9 +116,6 @@ static js_Ast *jsP_newnode(js_State *J, enum js_AstType type, js_Ast *a, js_Ast
 	if (c) c->parent = node;
 	if (d) d->parent = node;
 
-	node->gcnext = J->gcast;
-	J->gcast = node;
-
 	return node;
 }
 
@@ -112,25 +145,9 @@ static js_Ast *jsP_newnumnode(js_State *J, enum js_AstType type, double n)
 	return node;
 }
 
-static void jsP_freejumps(js_State *J, js_JumpList *node)
-{
-	while (node) {
-		js_JumpList *next = node->next;
-		js_free(J, node);
-		node = next;
-	}
-}
-
 void jsP_freeparse(js_State *J)
 {
-	js_Ast *node = J->gcast;
-	while (node) {
-		js_Ast *next = node->gcnext;
-		jsP_freejumps(J, node->jumps);
-		js_free(J, node);
-		node = next;
-	}
-	J->gcast = NULL;
+	jsP_release(J, NULL, NULL);
 }
 
 /* Lookahead */
@@ -139,6 +156,10 @@ static void jsP_next(js_State *J)
 {
 	J->lookahead = jsY_lex(J);
 	J->astline = J->lexline;
+	if (J->lookahead == TK_FUNCTION) {
+		J->funstart = J->lexstart;
+		J->funline = J->lexline;
+	}
 }
 
 #define jsP_accept(J,x) (J->lookahead == x ? (jsP_next(J), 1) : 0)
@@ -278,38 +299,69 @@ static js_Ast *parameters(js_State *J)
 	return jsP_list(head);
 }
 
+/*
+	When compiling lazily, the body of an inner function is only parsed to
+	check its syntax and then thrown away. The function keeps where it
+	began, so it can be parsed again when it is compiled.
+*/
+static js_Ast *lazybody(js_State *J)
+{
+	void *page = J->astpage;
+	char *next = J->astnext;
+	if (!J->lazyparse)
+		return funbody(J);
+	funbody(J);
+	jsP_release(J, page, next);
+	return NULL;
+}
+
+static js_Ast *funsource(js_State *J, js_Ast *fun, const char *start, int line)
+{
+	if (J->lazyparse) {
+		fun->source = start;
+		fun->sourceline = line;
+	}
+	return fun;
+}
+
 static js_Ast *fundec(js_State *J)
 {
+	const char *start = J->funstart;
+	int line = J->funline;
 	js_Ast *a, *b, *c;
 	a = identifier(J);
 	jsP_expect(J, '(');
 	b = parameters(J);
 	jsP_expect(J, ')');
-	c = funbody(J);
-	return jsP_newnode(J, AST_FUNDEC, a, b, c, 0);
+	c = lazybody(J);
+	return funsource(J, jsP_newnode(J, AST_FUNDEC, a, b, c, 0), start, line);
 }
 
 static js_Ast *funstm(js_State *J)
 {
+	const char *start = J->funstart;
+	int line = J->funline;
 	js_Ast *a, *b, *c;
 	a = identifier(J);
 	jsP_expect(J, '(');
 	b = parameters(J);
 	jsP_expect(J, ')');
-	c = funbody(J);
+	c = lazybody(J);
 	/* rewrite function statement as "var X = function X() {}" */
-	return STM1(VAR, LIST(EXP2(VAR, a, EXP3(FUN, a, b, c))));
+	return STM1(VAR, LIST(EXP2(VAR, a, funsource(J, EXP3(FUN, a, b, c), start, line))));
 }
 
 static js_Ast *funexp(js_State *J)
 {
+	const char *start = J->funstart;
+	int line = J->funline;
 	js_Ast *a, *b, *c;
 	a = identifieropt(J);
 	jsP_expect(J, '(');
 	b = parameters(J);
 	jsP_expect(J, ')');
-	c = funbody(J);
-	return EXP3(FUN, a, b, c);
+	c = lazybody(J);
+	return funsource(J, EXP3(FUN, a, b, c), start, line);
 }
 
 /* Expressions */
@@ -945,6 +997,14 @@ static int jsP_foldconst(js_Ast *node)
 	if (node->type == EXP_NUMBER)
 		return 1;
 
+	/* walk lists in a loop, so long array and object literals do not overflow the stack */
+	if (node->type == AST_LIST) {
+		for (; node; node = node->b)
+			if (node->a)
+				jsP_foldconst(node->a);
+		return 0;
+	}
+
 	a = node->a ? jsP_foldconst(node->a) : 0;
 	b = node->b ? jsP_foldconst(node->b) : 0;
 	if (node->c) jsP_foldconst(node->c);
@@ -988,6 +1048,8 @@ js_Ast *jsP_parse(js_State *J, const char *filename, const char *source)
 	js_Ast *p;
 
 	jsY_initlex(J, filename, source);
+	J->astsource = source;
+	J->lazyparse = J->lazycompile;
 	jsP_next(J);
 	J->astdepth = 0;
 	p = script(J, 0);
@@ -997,6 +1059,61 @@ js_Ast *jsP_parse(js_State *J, const char *filename, const char *source)
 	return p;
 }
 
+/*
+	A script read from a stream is parsed one element at a time, so each
+	can be compiled and its nodes thrown away before the next is read.
+*/
+void jsP_initstream(js_State *J, const char *filename, js_Read read, void *data)
+{
+	jsY_initstream(J, filename, read, data);
+	J->astsource = NULL;
+	J->lazyparse = 0;
+	jsP_next(J);
+}
+
+js_Ast *jsP_parsenext(js_State *J)
+{
+	void *page = J->astpage;
+	js_Ast *p;
+
+	/* the last element has been compiled; keep its first page for the next */
+	if (page) {
+		while (*(void**)page)
+			page = *(void**)page;
+		jsP_release(J, page, (char*)page + JS_POOLQUANTUM);
+	}
+
+	if (J->lookahead == 0)
+		return NULL;
+	J->astdepth = 0;
+	p = scriptelement(J);
+	jsP_foldconst(p);
+	return p;
+}
+
+/* Parse the function that begins at source + start again, with its body */
+js_Ast *jsP_parselazy(js_State *J, const char *filename, const char *source, int start, int line, int lazyinner)
+{
+	js_Ast *a, *b, *c, *p;
+
+	jsY_initlex(J, filename, source + start);
+	J->line = line;
+	J->astsource = source;
+	J->lazyparse = lazyinner;
+	jsP_next(J);
+	J->astdepth = 0;
+	jsP_expect(J, TK_FUNCTION);
+	a = identifieropt(J);
+	jsP_expect(J, '(');
+	b = parameters(J);
+	jsP_expect(J, ')');
+	c = funbody(J);
+	p = EXP3(FUN, a, b, c);
+	jsP_foldconst(p);
+
+	return p;
+}
+
 js_Ast *jsP_parsefunction(js_State *J, const char *filename, const char *params, const char *body)
 {
 	js_Ast *p = NULL;
@@ -132,11 +132,16 @@ struct js_Ast
 	const char *string;
 	js_JumpList *jumps; /* list of break/continue jumps to patch */
 	int casejump; /* for switch case clauses */
-	js_Ast *gcnext; /* next in alloc list */
+	const char *source; /* for functions whose body was skipped: where the 'function' keyword began */
+	int sourceline;
 };
 
 js_Ast *jsP_parsefunction(js_State *J, const char *filename, const char *params, const char *body);
 js_Ast *jsP_parse(js_State *J, const char *filename, const char *source);
+js_Ast *jsP_parselazy(js_State *J, const char *filename, const char *source, int start, int line, int lazyinner);
+void jsP_initstream(js_State *J, const char *filename, js_Read read, void *data);
+js_Ast *jsP_parsenext(js_State *J);
+void *jsP_alloc(js_State *J, int size);
 void jsP_freeparse(js_State *J);
 
 const char *jsP_aststring(enum js_AstType type);
@@ -1,5 +1,8 @@
 #include "jsi.h"
 #include "jsvalue.h"
+#include "jsbuiltin.h"
+
+#include "regexp.h"
 
 /*
 	Use an AA-tree to quickly look up properties in objects:
@@ -22,23 +25,22 @@ static js_Property sentinel = {
 	"",
 	&sentinel, &sentinel,
 	0, 0,
-	{ {0}, {0}, JS_TUNDEFINED },
-	NULL, NULL
+	{ { {0}, {0}, JS_TUNDEFINED } }
 };
 
 #define CHECK_PROP(prop) (prop && prop != &sentinel)
 
+#define PENDING(obj) ((obj)->type == JS_CARRAY && (obj)->u.a.match)
+
 static js_Property *newproperty(js_State *J, js_Object *obj, const char *name)
 {
-	js_Property *node = js_malloc(J, sizeof *node);
+	js_Property *node = js_poolalloc(J, sizeof *node);
 	node->name = js_intern(J, name);
 	node->left = node->right = &sentinel;
 	node->level = 1;
 	node->atts = 0;
-	node->value.type = JS_TUNDEFINED;
-	node->value.u.number = 0;
-	node->getter = NULL;
-	node->setter = NULL;
+	node->u.value.type = JS_TUNDEFINED;
+	node->u.value.u.number = 0;
 	++obj->count;
 	return node;
 }
@@ -104,7 +106,7 @@ static js_Property *insert(js_State *J, js_Object *obj, js_Property *node, const
 
 static void freeproperty(js_State *J, js_Object *obj, js_Property *node)
 {
-	js_free(J, node);
+	js_poolfree(J, node, sizeof *node);
 	--obj->count;
 }
 
@@ -133,7 +135,7 @@ static js_Property *delete(js_State *J, js_Object *obj, js_Property *node, const
 					succ = succ->left;
 				node->name = succ->name;
 				node->atts = succ->atts;
-				node->value = succ->value;
+				node->u = succ->u;
 				node->right = delete(J, obj, node->right, succ->name);
 			}
 		}
@@ -155,12 +157,11 @@ static js_Property *delete(js_State *J, js_Object *obj, js_Property *node, const
 
 js_Object *jp_newobject(js_State *J, enum js_Class type, js_Object *prototype)
 {
-	js_Object *obj = js_malloc(J, sizeof *obj);
+	js_Object *obj = js_poolalloc(J, sizeof *obj);
 	memset(obj, 0, sizeof *obj);
-	obj->gcmark = 0;
+	obj->gcmark = JS_GCNEWMARK(J);
 	obj->gcnext = J->gcobj;
 	J->gcobj = obj;
-	++J->gccounter;
 
 	obj->type = type;
 	obj->properties = &sentinel;
@@ -171,8 +172,93 @@ js_Object *jp_newobject(js_State *J, enum js_Class type, js_Object *prototype)
 
 
 
+/* Regexp match arrays */
+
+js_Object *jp_newmatch(js_State *J, js_Value *input, int index, Resub *m)
+{
+	const char *s = jv_tostring(J, input);
+	js_Object *obj;
+	js_Match *match;
+	int i;
+
+	obj = js_newobject(J, JS_CARRAY, J->Array_prototype);
+	obj->u.a.length = m->nsub;
+
+	match = js_malloc(J, soffsetof(js_Match, sub) + m->nsub * 2 * sizeof(int));
+	match->input = *input;
+	match->index = index;
+	match->nsub = m->nsub;
+	for (i = 0; i < m->nsub; ++i) {
+		match->sub[i*2] = m->sub[i].sp ? m->sub[i].sp - s : -1;
+		match->sub[i*2+1] = m->sub[i].sp ? m->sub[i].ep - s : -1;
+	}
+
+	obj->u.a.match = match;
+	return obj;
+}
+
+static int ismatchname(js_State *J, js_Object *obj, const char *name)
+{
+	int k;
+	if (!strcmp(name, "index") || !strcmp(name, "input"))
+		return 1;
+	return js_is_arr_index(J, name, &k) && k < obj->u.a.match->nsub;
+}
+
+void jp_materialize(js_State *J, js_Object *obj)
+{
+	js_Match *match;
+	js_Property *ref;
+	const char *s;
+	char buf[32];
+	int i;
+
+	/* everything is looked at, so create the libraries still put off */
+	if (obj == J->G && J->lazy)
+		jb_lazyinit(J, J->lazy);
+
+	if (!PENDING(obj))
+		return;
+
+	/* insert() reuses existing nodes, so this can be redone after an error */
+	match = obj->u.a.match;
+	s = jv_tostring(J, &match->input);
+
+	obj->properties = insert(J, obj, obj->properties, "input", &ref);
+	ref->u.value = match->input;
+	jsG_barrier(J, obj, &ref->u.value);
+
+	obj->properties = insert(J, obj, obj->properties, "index", &ref);
+	ref->u.value.type = JS_TNUMBER;
+	ref->u.value.u.number = match->index;
+
+	for (i = 0; i < match->nsub; ++i) {
+		if (match->sub[i*2] < 0)
+			js_push_literal(J, "");
+		else
+			js_push_lstr(J, s + match->sub[i*2], match->sub[i*2+1] - match->sub[i*2]);
+		obj->properties = insert(J, obj, obj->properties, js_itoa(buf, i), &ref);
+		ref->u.value = *js_tovalue(J, -1);
+		jsG_barrier(J, obj, &ref->u.value);
+		js_pop(J, 1);
+	}
+
+	obj->u.a.match = NULL;
+	js_free(J, match);
+}
+
+/* Create any property that has been put off before name is looked for */
+static void jp_pending(js_State *J, js_Object *obj, const char *name)
+{
+	if (PENDING(obj) && ismatchname(J, obj, name))
+		jp_materialize(J, obj);
+	else if (obj == J->G && J->lazy)
+		jb_lazyname(J, name);
+}
+
 js_Property *jp_getownproperty(js_State *J, js_Object *obj, const char *name)
 {
+	jp_pending(J, obj, name);
 	return find_obj_prop(obj, name);
 }
 
@@ -180,7 +266,9 @@ js_Property *jp_getpropertyx(js_State *J, js_Object *obj, const char *name, int
 {
 	*own = 1;
 	do {
-		js_Property *ref = find_obj_prop(obj, name);
+		js_Property *ref;
+		jp_pending(J, obj, name);
+		ref = find_obj_prop(obj, name);
 		if (ref)
 			return ref;
 		obj = obj->prototype;
@@ -198,7 +286,9 @@ js_Property *jp_getproperty(js_State *J, js_Object *obj, const char *name)
 static js_Property *jp_getenumproperty(js_State *J, js_Object *obj, const char *name)
 {
 	do {
-		js_Property *ref = find_obj_prop(obj, name);
+		js_Property *ref;
+		jp_pending(J, obj, name);
+		ref = find_obj_prop(obj, name);
 		if (ref && !(ref->atts & JS_DONTENUM))
 			return ref;
 		obj = obj->prototype;
@@ -210,6 +300,8 @@ js_Property *jp_setproperty(js_State *J, js_Object *obj, const char *name)
 {
 	js_Property *result;
 
+	jp_pending(J, obj, name);
+
 	if (!obj->extensible) {
 		result = find_obj_prop(obj, name);
 		if (J->strict && !result)
@@ -224,6 +316,7 @@ js_Property *jp_setproperty(js_State *J, js_Object *obj, const char *name)
 
 void jp_delproperty(js_State *J, js_Object *obj, const char *name)
 {
+	jp_pending(J, obj, name);
 	obj->properties = delete(J, obj, obj->properties, name);
 }
 
@@ -235,7 +328,7 @@ static js_Iterator *itwalk(js_State *J, js_Iterator *iter, js_Property *prop, js
 		iter = itwalk(J, iter, prop->right, seen);
 	if (!(prop->atts & JS_DONTENUM)) {
 		if (!seen || !jp_getenumproperty(J, seen, prop->name)) {
-			js_Iterator *head = js_malloc(J, sizeof *head);
+			js_Iterator *head = js_poolalloc(J, sizeof *head);
 			head->name = prop->name;
 			head->next = iter;
 			iter = head;
@@ -249,6 +342,7 @@ static js_Iterator *itwalk(js_State *J, js_Iterator *iter, js_Property *prop, js
 static js_Iterator *itflatten(js_State *J, js_Object *obj)
 {
 	js_Iterator *iter = NULL;
+	jp_materialize(J, obj);
 	if (obj->prototype)
 		iter = itflatten(J, obj->prototype);
 	if (CHECK_PROP(obj->properties))
@@ -263,6 +357,7 @@ js_Object *jp_newiterator(js_State *J, js_Object *obj, int own)
 	js_Object *io = js_newobject(J, JS_CITERATOR, NULL);
 	io->u.iter.target = obj;
 	if (own) {
+		jp_materialize(J, obj);
 		io->u.iter.head = NULL;
 		if (CHECK_PROP(obj->properties))
 			io->u.iter.head = itwalk(J, io->u.iter.head, obj->properties, NULL);
@@ -277,7 +372,7 @@ js_Object *jp_newiterator(js_State *J, js_Object *obj, int own)
 		for (k = 0; k < obj->u.s.length; ++k) {
 			js_itoa(buf, k);
 			if (!jp_getenumproperty(J, obj, buf)) {
-				js_Iterator *node = js_malloc(J, sizeof *node);
+				js_Iterator *node = js_poolalloc(J, sizeof *node);
 				node->name = js_intern(J, js_itoa(buf, k));
 				node->next = NULL;
 				if (!tail)
@@ -300,7 +395,7 @@ const char *jp_nextiterator(js_State *J, js_Object *io)
 	while (io->u.iter.head) {
 		js_Iterator *next = io->u.iter.head->next;
 		const char *name = io->u.iter.head->name;
-		js_free(J, io->u.iter.head);
+		js_poolfree(J, io->u.iter.head, sizeof *io->u.iter.head);
 		io->u.iter.head = next;
 		if (jp_getproperty(J, io->u.iter.target, name))
 			return name;
@@ -10,13 +10,14 @@ void js_new_regexp(js_State *J, const char *pattern, int flags)
 	Reprog *prog;
 	int opts;
 
+	JB_NEED(J, JB_REGEXP);
 	obj = js_newobject(J, JS_CREGEXP, J->RegExp_prototype);
 
 	opts = 0;
 	if (flags & JS_REGEXP_I) opts |= REG_ICASE;
 	if (flags & JS_REGEXP_M) opts |= REG_NEWLINE;
 
-	prog = js_regcompx(J->alloc, J->actx, pattern, opts, &error);
+	prog = js_regcompx(js_countalloc, J, pattern, opts, &error);
 	if (!prog)
 		js_error_syntax(J, "regular expression: %s", error);
 
@@ -24,83 +25,91 @@ void js_new_regexp(js_State *J, const char *pattern, int flags)
 	obj->u.r.source = js_strdup(J, pattern);
 	obj->u.r.flags = flags;
 	obj->u.r.last = 0;
+	obj->u.r.text = NULL;
+	obj->u.r.textsweep = 0;
+	obj->u.r.byte = 0;
 	js_push_object(J, obj);
 }
 
-void js_RegExp_prototype_exec(js_State *J, js_Regexp *re, const char *text)
+/* Find where a global search resumes, reusing the byte offset remembered
+ * from the previous match against the same string instead of rescanning it.
+ */
+static const char *js_regexp_resume(js_State *J, js_Regexp *re, const char *text)
 {
-	int i;
-	int opts;
-	Resub m;
+	if (re->last == 0)
+		return text;
+	if (re->last < 0)
+		return NULL;
+	/* a swept string's address may have been reused */
+	if (re->text == text && re->textsweep == J->gcsweeps)
+		return text + re->byte;
+	return js_utfidxtoptr(text, re->last);
+}
+
+int js_regexp_exec(js_State *J, js_Regexp *re, int idx, Resub *m, int *index)
+{
+	const char *text, *start;
+	int base, opts;
 
+	text = js_tostring(J, idx);
+	start = text;
+	base = 0;
 	opts = 0;
+
 	if (re->flags & JS_REGEXP_G) {
-		if (re->last > strlen(text)) {
+		start = js_regexp_resume(J, re, text);
+		if (!start) {
 			re->last = 0;
-			js_push_null(J);
-			return;
+			return 1;
 		}
-		if (re->last > 0) {
-			text += re->last;
+		base = re->last;
+		if (start > text)
 			opts |= REG_NOTBOL;
-		}
 	}
 
-	if (!js_regexec(re->prog, text, &m, opts)) {
-		js_new_array(J);
-		js_push_string(J, text);
-		js_set_prop(J, -2, "input");
-		js_push_number(J, js_utfptrtoidx(text, m.sub[0].sp));
-		js_set_prop(J, -2, "index");
-		for (i = 0; i < m.nsub; ++i) {
-			js_push_lstr(J, m.sub[i].sp, m.sub[i].ep - m.sub[i].sp);
-			js_set_index(J, -2, i);
-		}
+	if (js_regexec(re->prog, start, m, opts)) {
 		if (re->flags & JS_REGEXP_G)
-			re->last = re->last + (m.sub[0].ep - text);
-		return;
+			re->last = 0;
+		return 1;
 	}
 
-	if (re->flags & JS_REGEXP_G)
-		re->last = 0;
+	*index = base + js_utfptrtoidx(start, m->sub[0].sp);
 
-	js_push_null(J);
+	if (re->flags & JS_REGEXP_G) {
+		re->last = *index + js_utfptrtoidx(m->sub[0].sp, m->sub[0].ep);
+		/* short strings live in a stack slot, so their address is no key */
+		re->text = js_tovalue(J, idx)->type != JS_TSHRSTR ? text : NULL;
+		re->textsweep = J->gcsweeps;
+		re->byte = m->sub[0].ep - text;
+	}
+
+	return 0;
 }
 
-static void Rp_test(js_State *J)
+void js_RegExp_prototype_exec(js_State *J, js_Regexp *re, int idx)
 {
-	js_Regexp *re;
-	const char *text;
-	int opts;
+	int index;
 	Resub m;
 
-	re = js_toregexp(J, 0);
-	text = js_tostring(J, 1);
-
-	opts = 0;
-	if (re->flags & JS_REGEXP_G) {
-		if (re->last > strlen(text)) {
-			re->last = 0;
-			js_push_bool(J, 0);
-			return;
-		}
-		if (re->last > 0) {
-			text += re->last;
-			opts |= REG_NOTBOL;
-		}
+	/* the match keeps the string that was searched as its input, not the argument */
+	if (!js_is_string(J, idx)) {
+		js_push_string(J, js_tostring(J, idx));
+		idx = -1;
 	}
 
-	if (!js_regexec(re->prog, text, &m, opts)) {
-		if (re->flags & JS_REGEXP_G)
-			re->last = re->last + (m.sub[0].ep - text);
-		js_push_bool(J, 1);
+	if (!js_regexp_exec(J, re, idx, &m, &index)) {
+		js_push_object(J, jp_newmatch(J, js_tovalue(J, idx), index, &m));
 		return;
 	}
 
-	if (re->flags & JS_REGEXP_G)
-		re->last = 0;
+	js_push_null(J);
+}
 
-	js_push_bool(J, 0);
+static void Rp_test(js_State *J)
+{
+	int index;
+	Resub m;
+	js_push_bool(J, !js_regexp_exec(J, js_toregexp(J, 0), 1, &m, &index));
 }
 
 static void jsB_new_RegExp(js_State *J)
@@ -178,7 +187,7 @@ static void Rp_toString(js_State *J)
 
 static void Rp_exec(js_State *J)
 {
-	js_RegExp_prototype_exec(J, js_toregexp(J, 0), js_tostring(J, 1));
+	js_RegExp_prototype_exec(J, js_toregexp(J, 0), 1);
 }
 
 void jb_initregexp(js_State *J)
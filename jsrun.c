@@ -23,15 +23,77 @@ static void js_stackoverflow(js_State *J)
 
 static void js_outofmemory(js_State *J)
 {
+	if (J->memfault == 1) {
+		/* the state's own limit was hit; lift it a little so the error can be built and caught */
+		J->memfault = 2;
+		js_newerror_range(J, "out of memory");
+		js_throw(J);
+	}
 	STACK[TOP].type = JS_TLITSTR;
 	STACK[TOP].u.litstr = "out of memory";
 	++TOP;
 	js_throw(J);
 }
 
+/* Every block remembers its size, so the collector can count the bytes in use */
+
+typedef union { int size; double align; void *palign; } js_Header;
+
+/*
+	Would growing the heap by n bytes pass the limit? Finishing a sweep is
+	safe here, but marking is not: C code may hold new objects nothing
+	references yet. So a refused block asks for a full collection at the
+	next safe point instead.
+*/
+static int js_overlimit(js_State *J, int n)
+{
+	size_t limit = J->memlimit;
+	/* the reserve is no longer in use once the error's memory has been freed */
+	if (J->memfault && J->gcbytes + JS_MEMRESERVE * 1024 < J->memlimit)
+		J->memfault = 0;
+	if (J->memfault == 2)
+		limit += JS_MEMRESERVE * 1024;
+	if (J->gcbytes + n <= limit)
+		return 0;
+	jsG_sweepall(J);
+	if (J->gcbytes + n <= limit)
+		return 0;
+	if (J->memfault == 0)
+		J->memfault = 1;
+	J->gcurgent = JS_MEMRETRY;
+	J->gcneed = n;
+	J->gclimit = 0;
+	return 1;
+}
+
+void *js_countalloc(void *actx, void *ptr, int size)
+{
+	js_State *J = actx;
+	js_Header *h = ptr ? (js_Header *)ptr - 1 : NULL;
+	int old = h ? h->size : 0;
+	if (size == 0) {
+		J->gcbytes -= old;
+		J->alloc(J->actx, h, 0);
+		return NULL;
+	}
+	if (J->memlimit && size > old && js_overlimit(J, size - old))
+		return NULL;
+	h = J->alloc(J->actx, h, size + sizeof *h);
+	if (!h)
+		return NULL;
+	if (!ptr)
+		++J->gcstats.allocations;
+	if (size > old)
+		J->gcstats.allocated += size - old;
+	J->gcbytes += size;
+	J->gcbytes -= old;
+	h->size = size;
+	return h + 1;
+}
+
 void *js_malloc(js_State *J, int size)
 {
-	void *ptr = J->alloc(J->actx, NULL, size);
+	void *ptr = js_countalloc(J, NULL, size);
 	if (!ptr)
 		js_outofmemory(J);
 	return ptr;
@@ -39,7 +101,7 @@ void *js_malloc(js_State *J, int size)
 
 void *js_realloc(js_State *J, void *ptr, int size)
 {
-	ptr = J->alloc(J->actx, ptr, size);
+	ptr = js_countalloc(J, ptr, size);
 	if (!ptr)
 		js_outofmemory(J);
 	return ptr;
@@ -55,7 +117,65 @@ char *js_strdup(js_State *J, const char *s)
 
 void js_free(js_State *J, void *ptr)
 {
-	J->alloc(J->actx, ptr, 0);
+	if (ptr)
+		js_countalloc(J, ptr, 0);
+}
+
+/* Free a block that has outlived the state that made it */
+void js_freeblock(js_Alloc alloc, void *actx, void *ptr)
+{
+	if (ptr)
+		alloc(actx, (js_Header *)ptr - 1, 0);
+}
+
+int js_blocksize(void *ptr)
+{
+	return ptr ? ((js_Header *)ptr - 1)->size : 0;
+}
+
+/* Objects, properties, environments, iterators and short strings come from
+ * per-size free lists carved out of pages, which go back to the allocator
+ * when the state is freed. The same size must be passed to free a block.
+ */
+
+static void js_poolgrow(js_State *J, int c)
+{
+	int size = (c + 1) * JS_POOLQUANTUM;
+	char *page, *p;
+	page = J->alloc(J->actx, NULL, JS_POOLPAGE);
+	if (!page)
+		js_outofmemory(J);
+	*(void **)page = J->poolpages;
+	J->poolpages = page;
+	/* the first quantum holds the page link */
+	for (p = page + JS_POOLQUANTUM; p + size <= page + JS_POOLPAGE; p += size) {
+		*(void **)p = J->pool[c];
+		J->pool[c] = p;
+	}
+}
+
+void *js_poolalloc(js_State *J, int size)
+{
+	int c = (size - 1) / JS_POOLQUANTUM;
+	void **cell;
+	if (J->memlimit && js_overlimit(J, (c + 1) * JS_POOLQUANTUM))
+		js_outofmemory(J);
+	if (!J->pool[c])
+		js_poolgrow(J, c);
+	cell = J->pool[c];
+	J->pool[c] = *cell;
+	J->gcbytes += (c + 1) * JS_POOLQUANTUM;
+	J->gcstats.allocated += (c + 1) * JS_POOLQUANTUM;
+	++J->gcstats.allocations;
+	return cell;
+}
+
+void js_poolfree(js_State *J, void *ptr, int size)
+{
+	int c = (size - 1) / JS_POOLQUANTUM;
+	*(void **)ptr = J->pool[c];
+	J->pool[c] = ptr;
+	J->gcbytes -= (c + 1) * JS_POOLQUANTUM;
 }
 
 
@@ -229,11 +349,11 @@ static const char *js_typeof(js_State *J, int idx)
 		return "object";
 	}
 }
-
+
 js_Value *js_tovalue(js_State *J, int idx)
 {
 	return stackidx(J, idx);
-}
+}
 
 int js_toboolean(js_State *J, int idx)
 {
@@ -464,6 +584,16 @@ static int jr_hasproperty(js_State *J, js_Object *obj, const char *name)
 			js_push_number(J, obj->u.a.length);
 			return 1;
 		}
+		if (obj->u.a.match) {
+			if (!strcmp(name, "index")) {
+				js_push_number(J, obj->u.a.match->index);
+				return 1;
+			}
+			if (!strcmp(name, "input")) {
+				js_push_value(J, obj->u.a.match->input);
+				return 1;
+			}
+		}
 	}
 
 	else if (obj->type == JS_CSTRING) {
@@ -509,12 +639,14 @@ static int jr_hasproperty(js_State *J, js_Object *obj, const char *name)
 
 	ref = jp_getproperty(J, obj, name);
 	if (ref) {
-		if (ref->getter) {
-			js_push_object(J, ref->getter);
+		if (!(ref->atts & JS_ACCESSOR)) {
+			js_push_value(J, ref->u.value);
+		} else if (ref->u.acc.getter) {
+			js_push_object(J, ref->u.acc.getter);
 			js_push_object(J, obj);
 			js_call(J, 0);
 		} else {
-			js_push_value(J, ref->value);
+			js_push_undef(J);
 		}
 		return 1;
 	}
@@ -564,6 +696,7 @@ static void jr_setproperty(js_State *J, js_Object *obj, const char *name)
 		if (!strcmp(name, "multiline")) goto readonly;
 		if (!strcmp(name, "lastIndex")) {
 			obj->u.r.last = jv_tointeger(J, value);
+			obj->u.r.text = NULL;
 			return;
 		}
 	}
@@ -575,19 +708,16 @@ static void jr_setproperty(js_State *J, js_Object *obj, const char *name)
 
 	/* First try to find a setter in prototype chain */
 	ref = jp_getpropertyx(J, obj, name, &own);
-	if (ref) {
-		if (ref->setter) {
-			js_push_object(J, ref->setter);
+	if (ref && (ref->atts & JS_ACCESSOR)) {
+		if (ref->u.acc.setter) {
+			js_push_object(J, ref->u.acc.setter);
 			js_push_object(J, obj);
 			js_push_value(J, *value);
 			js_call(J, 1);
 			js_pop(J, 1);
-			return;
-		} else {
-			if (J->strict)
-				if (ref->getter)
-					js_error_type(J, "setting property '%s' that only has a getter", name);
-		}
+		} else if (J->strict)
+			js_error_type(J, "setting property '%s' that only has a getter", name);
+		return;
 	}
 
 	/* Property not found on this object, so create one */
@@ -595,9 +725,10 @@ static void jr_setproperty(js_State *J, js_Object *obj, const char *name)
 		ref = jp_setproperty(J, obj, name);
 
 	if (ref) {
-		if (!(ref->atts & JS_READONLY))
-			ref->value = *value;
-		else
+		if (!(ref->atts & JS_READONLY)) {
+			ref->u.value = *value;
+			jsG_barrier(J, obj, value);
+		} else
 			goto readonly;
 	}
 
@@ -643,21 +774,43 @@ static void jr_defproperty(js_State *J, js_Object *obj, const char *name,
 	ref = jp_setproperty(J, obj, name);
 	if (ref) {
 		if (value) {
-			if (!(ref->atts & JS_READONLY))
-				ref->value = *value;
-			else if (J->strict)
+			if (ref->atts & JS_ACCESSOR) {
+				/* turn the accessor back into a data property */
+				if (!(ref->atts & JS_DONTCONF)) {
+					ref->atts &= ~JS_ACCESSOR;
+					ref->u.value = *value;
+					jsG_barrier(J, obj, value);
+				} else if (J->strict)
+					js_error_type(J, "'%s' is non-configurable", name);
+			} else if (!(ref->atts & JS_READONLY)) {
+				ref->u.value = *value;
+				jsG_barrier(J, obj, value);
+			} else if (J->strict)
 				js_error_type(J, "'%s' is read-only", name);
 		}
+		if ((getter || setter) && !(ref->atts & JS_ACCESSOR)) {
+			if (!(ref->atts & JS_DONTCONF)) {
+				ref->atts |= JS_ACCESSOR;
+				ref->u.acc.getter = NULL;
+				ref->u.acc.setter = NULL;
+			} else {
+				if (J->strict)
+					js_error_type(J, "'%s' is non-configurable", name);
+				getter = setter = NULL;
+			}
+		}
 		if (getter) {
-			if (!(ref->atts & JS_DONTCONF))
-				ref->getter = getter;
-			else if (J->strict)
+			if (!(ref->atts & JS_DONTCONF)) {
+				ref->u.acc.getter = getter;
+				jsG_barrierobject(J, obj, getter);
+			} else if (J->strict)
 				js_error_type(J, "'%s' is non-configurable", name);
 		}
 		if (setter) {
-			if (!(ref->atts & JS_DONTCONF))
-				ref->setter = setter;
-			else if (J->strict)
+			if (!(ref->atts & JS_DONTCONF)) {
+				ref->u.acc.setter = setter;
+				jsG_barrierobject(J, obj, setter);
+			} else if (J->strict)
 				js_error_type(J, "'%s' is non-configurable", name);
 		}
 		ref->atts |= atts;
@@ -828,11 +981,10 @@ const char *js_next_iterator(js_State *J, int idx)
 
 js_Env *jsR_newenvironment(js_State *J, js_Object *vars, js_Env *outer)
 {
-	js_Env *E = js_malloc(J, sizeof *E);
-	E->gcmark = 0;
+	js_Env *E = js_poolalloc(J, sizeof *E);
+	E->gcmark = JS_GCNEWMARK(J);
 	E->gcnext = J->gcenv;
 	J->gcenv = E;
-	++J->gccounter;
 
 	E->outer     = outer;
 	E->variables = vars;
@@ -855,12 +1007,14 @@ static int js_hasvar(js_State *J, const char *name)
 	do {
 		js_Property *ref = jp_getproperty(J, E->variables, name);
 		if (ref) {
-			if (ref->getter) {
-				js_push_object(J, ref->getter);
+			if (!(ref->atts & JS_ACCESSOR)) {
+				js_push_value(J, ref->u.value);
+			} else if (ref->u.acc.getter) {
+				js_push_object(J, ref->u.acc.getter);
 				js_push_object(J, E->variables);
 				js_call(J, 0);
 			} else {
-				js_push_value(J, ref->value);
+				js_push_undef(J);
 			}
 			return 1;
 		}
@@ -872,20 +1026,25 @@ static int js_hasvar(js_State *J, const char *name)
 static void js_setvar(js_State *J, const char *name)
 {
 	js_Env *E = J->E;
+	int own;
 	do {
-		js_Property *ref = jp_getproperty(J, E->variables, name);
+		js_Property *ref = jp_getpropertyx(J, E->variables, name, &own);
 		if (ref) {
-			if (ref->setter) {
-				js_push_object(J, ref->setter);
-				js_push_object(J, E->variables);
-				js_copy(J, -3);
-				js_call(J, 1);
-				js_pop(J, 1);
+			if (ref->atts & JS_ACCESSOR) {
+				if (ref->u.acc.setter) {
+					js_push_object(J, ref->u.acc.setter);
+					js_push_object(J, E->variables);
+					js_copy(J, -3);
+					js_call(J, 1);
+					js_pop(J, 1);
+				} else if (J->strict)
+					js_error_type(J, "setting property '%s' that only has a getter", name);
 				return;
 			}
-			if (!(ref->atts & JS_READONLY))
-				ref->value = *stackidx(J, -1);
-			else if (J->strict)
+			if (!(ref->atts & JS_READONLY)) {
+				ref->u.value = *stackidx(J, -1);
+				jsG_barrier(J, own ? E->variables : NULL, &ref->u.value);
+			} else if (J->strict)
 				js_error_type(J, "'%s' is read-only", name);
 			return;
 		}
@@ -1047,6 +1206,9 @@ void js_call(js_State *J, int n)
 
 	obj = js_toobject(J, -n-2);
 
+	if (obj->type == JS_CFUNCTION && obj->u.f.function->lazy)
+		jsC_compilelazy(J, obj->u.f.function, J->lazycompile);
+
 	savebot = BOT;
 	BOT = TOP - n - 1;
 
@@ -1290,10 +1452,8 @@ static void jsR_run(js_State *J, js_Function *F)
 	J->strict  = F->strict;
 
 	while (1) {
-		if (J->gccounter > JS_GCLIMIT) {
-			J->gccounter = 0;
-			js_gc(J, 0);
-		}
+		if (J->gcbytes > J->gclimit)
+			jsG_step(J);
 
 		opcode = *pc++;
 		switch (opcode) {
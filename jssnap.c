@@ -0,0 +1,755 @@
+#include "jsi.h"
+#include "jscompile.h"
+#include "jsvalue.h"
+#include "jsrun.h"
+#include "regexp.h"
+
+/*
+	Heap snapshots. js_snapshot writes every string, function, environment
+	and object left after a full collection, along with any functions
+	frozen by js_clonestate or loaded from modules, then the state's
+	roots, into one block of memory. References between them are stored
+	as indices into those four lists (0 for NULL), so js_restorestate can
+	allocate every node up front and then fill them in with one pass over
+	the data.
+
+	The snapshot holds C function and userdata pointers as they are, so
+	it only makes sense in the process that made it, or in processes
+	forked from that one afterwards. The address of jsS_cookie is stored
+	to catch any other use.
+*/
+
+#define JS_SNAPMAGIC "\033JSS"
+#define JS_SNAPVERSION 4
+
+static const char jsS_cookie = 0;
+
+enum { S_STRING, S_FUNCTION, S_ENV, S_OBJECT, S_KINDS };
+
+typedef struct
+{
+	const void **ptr;
+	int n;
+} jsS_Index;
+
+typedef struct
+{
+	char *buf;
+	int n, cap;
+	jsS_Index index[S_KINDS];
+} jsS_Writer;
+
+static int jsS_cmp(const void *a, const void *b)
+{
+	const char *x = *(const void * const *)a;
+	const char *y = *(const void * const *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Saving */
+
+static void jsS_putmem(js_State *J, jsS_Writer *w, const void *p, int n)
+{
+	if (w->n + n > w->cap) {
+		int cap = w->cap ? w->cap : 4096;
+		char *buf;
+		while (cap < w->n + n)
+			cap *= 2;
+		buf = J->alloc(J->actx, w->buf, cap);
+		if (!buf)
+			js_error(J, "out of memory");
+		w->buf = buf;
+		w->cap = cap;
+	}
+	memcpy(w->buf + w->n, p, n);
+	w->n += n;
+}
+
+static void jsS_putint(js_State *J, jsS_Writer *w, int v)
+{
+	jsS_putmem(J, w, &v, sizeof v);
+}
+
+static void jsS_putnumber(js_State *J, jsS_Writer *w, double v)
+{
+	jsS_putmem(J, w, &v, sizeof v);
+}
+
+/* a null pointer is stored as length -1 */
+static void jsS_putstring(js_State *J, jsS_Writer *w, const char *s)
+{
+	int n = s ? (int)strlen(s) : -1;
+	jsS_putint(J, w, n);
+	if (s)
+		jsS_putmem(J, w, s, n + 1);
+}
+
+static void jsS_putref(js_State *J, jsS_Writer *w, int kind, const void *ptr)
+{
+	jsS_Index *x = &w->index[kind];
+	const void **p;
+	if (!ptr) {
+		jsS_putint(J, w, 0);
+		return;
+	}
+	p = bsearch(&ptr, x->ptr, x->n, sizeof *x->ptr, jsS_cmp);
+	if (!p)
+		js_error(J, "cannot snapshot a reference to a dead node");
+	jsS_putint(J, w, p - x->ptr + 1);
+}
+
+static void jsS_putvalue(js_State *J, jsS_Writer *w, js_Value *v)
+{
+	jsS_putint(J, w, v->type);
+	switch (v->type) {
+	case JS_TSHRSTR: jsS_putstring(J, w, v->u.shrstr); break;
+	case JS_TUNDEFINED: break;
+	case JS_TNULL: break;
+	case JS_TBOOLEAN: jsS_putint(J, w, v->u.boolean); break;
+	case JS_TNUMBER: jsS_putnumber(J, w, v->u.number); break;
+	case JS_TLITSTR: jsS_putstring(J, w, v->u.litstr); break;
+	case JS_TMEMSTR: jsS_putref(J, w, S_STRING, v->u.memstr); break;
+	case JS_TOBJECT: jsS_putref(J, w, S_OBJECT, v->u.object); break;
+	}
+}
+
+static int jsS_countproperties(js_Property *node)
+{
+	if (!node->level)
+		return 0;
+	return 1 + jsS_countproperties(node->left) + jsS_countproperties(node->right);
+}
+
+static void jsS_putproperties(js_State *J, jsS_Writer *w, js_Property *node)
+{
+	if (!node->level)
+		return;
+	jsS_putproperties(J, w, node->left);
+	jsS_putstring(J, w, node->name);
+	jsS_putint(J, w, node->atts);
+	if (node->atts & JS_ACCESSOR) {
+		jsS_putref(J, w, S_OBJECT, node->u.acc.getter);
+		jsS_putref(J, w, S_OBJECT, node->u.acc.setter);
+	} else {
+		jsS_putvalue(J, w, &node->u.value);
+	}
+	jsS_putproperties(J, w, node->right);
+}
+
+static void jsS_putfunction(js_State *J, jsS_Writer *w, js_Function *F)
+{
+	int i;
+	jsS_putstring(J, w, F->name);
+	jsS_putstring(J, w, F->filename);
+	jsS_putint(J, w, F->script);
+	jsS_putint(J, w, F->lightweight);
+	jsS_putint(J, w, F->strict);
+	jsS_putint(J, w, F->arguments);
+	jsS_putint(J, w, F->numparams);
+	jsS_putint(J, w, F->line);
+	jsS_putint(J, w, F->lastline);
+	jsS_putint(J, w, F->codelen);
+	jsS_putmem(J, w, F->code, F->codelen * sizeof *F->code);
+	jsS_putint(J, w, F->numlen);
+	jsS_putmem(J, w, F->numtab, F->numlen * sizeof *F->numtab);
+	jsS_putint(J, w, F->strlen);
+	for (i = 0; i < F->strlen; ++i)
+		jsS_putstring(J, w, F->strtab[i]);
+	jsS_putint(J, w, F->varlen);
+	for (i = 0; i < F->varlen; ++i)
+		jsS_putstring(J, w, F->vartab[i]);
+	jsS_putint(J, w, F->funlen);
+	for (i = 0; i < F->funlen; ++i)
+		jsS_putref(J, w, S_FUNCTION, F->funtab[i]);
+}
+
+static void jsS_putobject(js_State *J, jsS_Writer *w, js_Object *obj)
+{
+	js_Iterator *node;
+	int n;
+
+	jsS_putint(J, w, obj->type);
+	jsS_putint(J, w, obj->extensible);
+	jsS_putref(J, w, S_OBJECT, obj->prototype);
+	jsS_putint(J, w, jsS_countproperties(obj->properties));
+	jsS_putproperties(J, w, obj->properties);
+
+	switch (obj->type) {
+	case JS_COBJECT:
+	case JS_CERROR:
+	case JS_CMATH:
+	case JS_CJSON:
+		break;
+	case JS_CARRAY:
+		jsS_putint(J, w, obj->u.a.length);
+		break;
+	case JS_CFUNCTION:
+	case JS_CSCRIPT:
+		jsS_putref(J, w, S_FUNCTION, obj->u.f.function);
+		jsS_putref(J, w, S_ENV, obj->u.f.scope);
+		break;
+	case JS_CCFUNCTION:
+		jsS_putstring(J, w, obj->u.c.name);
+		jsS_putmem(J, w, &obj->u.c.function, sizeof obj->u.c.function);
+		jsS_putmem(J, w, &obj->u.c.constructor, sizeof obj->u.c.constructor);
+		jsS_putint(J, w, obj->u.c.length);
+		break;
+	case JS_CBOOLEAN:
+		jsS_putint(J, w, obj->u.boolean);
+		break;
+	case JS_CNUMBER:
+	case JS_CDATE:
+		jsS_putnumber(J, w, obj->u.number);
+		break;
+	case JS_CSTRING:
+		jsS_putstring(J, w, obj->u.s.string);
+		jsS_putint(J, w, obj->u.s.length);
+		break;
+	case JS_CREGEXP:
+		jsS_putstring(J, w, obj->u.r.source);
+		jsS_putint(J, w, obj->u.r.flags);
+		jsS_putint(J, w, obj->u.r.last);
+		break;
+	case JS_CITERATOR:
+		jsS_putref(J, w, S_OBJECT, obj->u.iter.target);
+		for (n = 0, node = obj->u.iter.head; node; node = node->next)
+			++n;
+		jsS_putint(J, w, n);
+		for (node = obj->u.iter.head; node; node = node->next)
+			jsS_putstring(J, w, node->name);
+		break;
+	case JS_CUSERDATA:
+		if (obj->u.user.finalize)
+			js_error(J, "cannot snapshot userdata with a finalizer");
+		jsS_putstring(J, w, obj->u.user.tag);
+		jsS_putmem(J, w, &obj->u.user.data, sizeof obj->u.user.data);
+		jsS_putmem(J, w, &obj->u.user.has, sizeof obj->u.user.has);
+		jsS_putmem(J, w, &obj->u.user.put, sizeof obj->u.user.put);
+		jsS_putmem(J, w, &obj->u.user.delete, sizeof obj->u.user.delete);
+		break;
+	}
+}
+
+static void jsS_index(js_State *J, jsS_Index *x, int n)
+{
+	x->ptr = js_malloc(J, (n > 0 ? n : 1) * sizeof *x->ptr);
+	x->n = 0;
+}
+
+static void jsS_write(js_State *J, jsS_Writer *w)
+{
+	js_Object **protos = &J->Object_prototype;
+	const void *cookie = &jsS_cookie;
+	js_String *str;
+	js_Function *fun;
+	js_Env *env;
+	js_Object *obj;
+	js_Shared *S;
+	int i, n[S_KINDS] = { 0 };
+
+	for (str = J->gcstr; str; str = str->gcnext) ++n[S_STRING];
+	for (fun = J->gcfun; fun; fun = fun->gcnext) ++n[S_FUNCTION];
+	for (S = J->shared; S; S = S->parent)
+		for (fun = S->fun; fun; fun = fun->gcnext) ++n[S_FUNCTION];
+	for (i = 0; i < J->nmodules; ++i)
+		for (fun = J->modules[i]->fun; fun; fun = fun->gcnext) ++n[S_FUNCTION];
+	for (env = J->gcenv; env; env = env->gcnext) ++n[S_ENV];
+	for (obj = J->gcobj; obj; obj = obj->gcnext) ++n[S_OBJECT];
+
+	for (i = 0; i < S_KINDS; ++i)
+		jsS_index(J, &w->index[i], n[i]);
+	for (str = J->gcstr; str; str = str->gcnext) w->index[S_STRING].ptr[w->index[S_STRING].n++] = str;
+	for (fun = J->gcfun; fun; fun = fun->gcnext) w->index[S_FUNCTION].ptr[w->index[S_FUNCTION].n++] = fun;
+	for (S = J->shared; S; S = S->parent)
+		for (fun = S->fun; fun; fun = fun->gcnext) w->index[S_FUNCTION].ptr[w->index[S_FUNCTION].n++] = fun;
+	for (i = 0; i < J->nmodules; ++i)
+		for (fun = J->modules[i]->fun; fun; fun = fun->gcnext) w->index[S_FUNCTION].ptr[w->index[S_FUNCTION].n++] = fun;
+	for (env = J->gcenv; env; env = env->gcnext) w->index[S_ENV].ptr[w->index[S_ENV].n++] = env;
+	for (obj = J->gcobj; obj; obj = obj->gcnext) w->index[S_OBJECT].ptr[w->index[S_OBJECT].n++] = obj;
+	for (i = 0; i < S_KINDS; ++i)
+		qsort(w->index[i].ptr, w->index[i].n, sizeof *w->index[i].ptr, jsS_cmp);
+
+	jsS_putmem(J, w, JS_SNAPMAGIC, 4);
+	jsS_putint(J, w, JS_SNAPVERSION);
+	jsS_putmem(J, w, &cookie, sizeof cookie);
+	for (i = 0; i < S_KINDS; ++i)
+		jsS_putint(J, w, n[i]);
+
+	/* every section is in index order, so a node's position is its index */
+	for (i = 0; i < n[S_STRING]; ++i)
+		jsS_putstring(J, w, ((const js_String *)w->index[S_STRING].ptr[i])->p);
+	for (i = 0; i < n[S_FUNCTION]; ++i)
+		jsS_putfunction(J, w, (js_Function *)w->index[S_FUNCTION].ptr[i]);
+	for (i = 0; i < n[S_ENV]; ++i) {
+		env = (js_Env *)w->index[S_ENV].ptr[i];
+		jsS_putref(J, w, S_OBJECT, env->variables);
+		jsS_putref(J, w, S_ENV, env->outer);
+	}
+	for (i = 0; i < n[S_OBJECT]; ++i)
+		jsS_putobject(J, w, (js_Object *)w->index[S_OBJECT].ptr[i]);
+
+	/* the roots: prototypes from Object_prototype to URIError_prototype, then the rest */
+	for (i = 0; &protos[i] <= &J->URIError_prototype; ++i)
+		jsS_putref(J, w, S_OBJECT, protos[i]);
+	jsS_putref(J, w, S_OBJECT, J->R);
+	jsS_putref(J, w, S_OBJECT, J->G);
+	jsS_putref(J, w, S_ENV, J->E);
+	jsS_putref(J, w, S_ENV, J->GE);
+	jsS_putint(J, w, J->nextref);
+	jsS_putint(J, w, J->lazy);
+	jsS_putint(J, w, J->default_strict);
+	jsS_putint(J, w, J->lazycompile);
+	jsS_putint(J, w, J->top);
+	for (i = 0; i < J->top; ++i)
+		jsS_putvalue(J, w, &J->stack[i]);
+
+	jsS_putmem(J, w, &J->report, sizeof J->report);
+	jsS_putmem(J, w, &J->panic, sizeof J->panic);
+	jsS_putmem(J, w, &J->finalize, sizeof J->finalize);
+	jsS_putint(J, w, J->gcpause);
+	jsS_putint(J, w, J->gcminheap);
+	jsS_putint(J, w, J->gcnursery);
+	jsS_putint(J, w, J->gcincremental);
+	jsS_putint(J, w, J->gcstepsize);
+	jsS_putint(J, w, J->gcstepmul);
+	jsS_putint(J, w, J->gcgenerational);
+	jsS_putmem(J, w, &J->memlimit, sizeof J->memlimit);
+	jsS_putint(J, w, J->codemax);
+}
+
+void *js_snapshot(js_State *J, int *size)
+{
+	jsS_Writer w;
+	js_Object *obj;
+	int i;
+
+	if (J->bot > 0 || J->envtop > 0)
+		js_error(J, "cannot snapshot a running state");
+
+	/* only live nodes are left on the lists after a full collection */
+	jsC_compileall(J);
+	js_gc(J, 0);
+	for (obj = J->gcobj; obj; obj = obj->gcnext)
+		if (obj->type == JS_CARRAY && obj->u.a.match)
+			jp_materialize(J, obj);
+
+	memset(&w, 0, sizeof w);
+	if (js_try(J)) {
+		for (i = 0; i < S_KINDS; ++i)
+			js_free(J, w.index[i].ptr);
+		J->alloc(J->actx, w.buf, 0);
+		js_throw(J);
+	}
+	jsS_write(J, &w);
+	js_endtry(J);
+
+	for (i = 0; i < S_KINDS; ++i)
+		js_free(J, w.index[i].ptr);
+	*size = w.n;
+	return w.buf;
+}
+
+/* Restoring */
+
+typedef struct
+{
+	const char *p, *end;
+	void **node[S_KINDS];
+	int n[S_KINDS];
+} jsS_Reader;
+
+/* the data was checked to come from this process, so only guard against truncation */
+static JS_NORETURN void jsS_error(js_State *J)
+{
+	js_push_literal(J, "invalid snapshot");
+	js_throw(J);
+}
+
+static void jsS_getmem(js_State *J, jsS_Reader *r, void *p, int n)
+{
+	if (n < 0 || n > r->end - r->p)
+		jsS_error(J);
+	memcpy(p, r->p, n);
+	r->p += n;
+}
+
+static int jsS_getint(js_State *J, jsS_Reader *r)
+{
+	int v;
+	jsS_getmem(J, r, &v, sizeof v);
+	return v;
+}
+
+static double jsS_getnumber(js_State *J, jsS_Reader *r)
+{
+	double v;
+	jsS_getmem(J, r, &v, sizeof v);
+	return v;
+}
+
+/* points into the snapshot; intern it to keep it */
+static const char *jsS_getstring(js_State *J, jsS_Reader *r)
+{
+	const char *s;
+	int n = jsS_getint(J, r);
+	if (n == -1)
+		return NULL;
+	if (n < 0 || n >= r->end - r->p || r->p[n] != 0)
+		jsS_error(J);
+	s = r->p;
+	r->p += n + 1;
+	return s;
+}
+
+static const char *jsS_getintern(js_State *J, jsS_Reader *r)
+{
+	const char *s = jsS_getstring(J, r);
+	return s ? js_intern(J, s) : NULL;
+}
+
+static void *jsS_getref(js_State *J, jsS_Reader *r, int kind)
+{
+	int i = jsS_getint(J, r);
+	if (i < 0 || i > r->n[kind])
+		jsS_error(J);
+	return i ? r->node[kind][i-1] : NULL;
+}
+
+static void jsS_getvalue(js_State *J, jsS_Reader *r, js_Value *v)
+{
+	const char *s;
+	int type = jsS_getint(J, r);
+	memset(v, 0, sizeof *v);
+	switch (type) {
+	case JS_TSHRSTR:
+		s = jsS_getstring(J, r);
+		if (!s || strlen(s) >= sizeof v->u.shrstr + sizeof v->pad)
+			jsS_error(J);
+		strcpy(v->u.shrstr, s);
+		break;
+	case JS_TUNDEFINED: break;
+	case JS_TNULL: break;
+	case JS_TBOOLEAN: v->u.boolean = jsS_getint(J, r); break;
+	case JS_TNUMBER: v->u.number = jsS_getnumber(J, r); break;
+	case JS_TLITSTR:
+		v->u.litstr = jsS_getintern(J, r);
+		if (!v->u.litstr)
+			jsS_error(J);
+		break;
+	case JS_TMEMSTR:
+		v->u.memstr = jsS_getref(J, r, S_STRING);
+		if (!v->u.memstr)
+			jsS_error(J);
+		break;
+	case JS_TOBJECT:
+		v->u.object = jsS_getref(J, r, S_OBJECT);
+		if (!v->u.object)
+			jsS_error(J);
+		break;
+	default:
+		jsS_error(J);
+	}
+	v->type = type;
+}
+
+static void jsS_getfunction(js_State *J, jsS_Reader *r, js_Function *F)
+{
+	int n;
+
+	F->name = jsS_getintern(J, r);
+	F->filename = jsS_getintern(J, r);
+	if (!F->name || !F->filename)
+		jsS_error(J);
+	F->script = jsS_getint(J, r);
+	F->lightweight = jsS_getint(J, r);
+	F->strict = jsS_getint(J, r);
+	F->arguments = jsS_getint(J, r);
+	F->numparams = jsS_getint(J, r);
+	F->line = jsS_getint(J, r);
+	F->lastline = jsS_getint(J, r);
+
+	n = jsS_getint(J, r);
+	if (n < 0 || n > (r->end - r->p) / (int)sizeof *F->code)
+		jsS_error(J);
+	F->code = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->code);
+	F->codecap = F->codelen = n;
+	jsS_getmem(J, r, F->code, n * sizeof *F->code);
+
+	n = jsS_getint(J, r);
+	if (n < 0 || n > (r->end - r->p) / (int)sizeof *F->numtab)
+		jsS_error(J);
+	F->numtab = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->numtab);
+	F->numcap = F->numlen = n;
+	jsS_getmem(J, r, F->numtab, n * sizeof *F->numtab);
+
+	n = jsS_getint(J, r);
+	if (n < 0 || n > r->end - r->p)
+		jsS_error(J);
+	F->strtab = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->strtab);
+	F->strcap = n;
+	while (F->strlen < n)
+		if (!(F->strtab[F->strlen++] = jsS_getintern(J, r)))
+			jsS_error(J);
+
+	n = jsS_getint(J, r);
+	if (n < 0 || n > r->end - r->p)
+		jsS_error(J);
+	F->vartab = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->vartab);
+	F->varcap = n;
+	while (F->varlen < n)
+		if (!(F->vartab[F->varlen++] = jsS_getintern(J, r)))
+			jsS_error(J);
+
+	n = jsS_getint(J, r);
+	if (n < 0 || n > r->end - r->p)
+		jsS_error(J);
+	F->funtab = js_malloc(J, (n > 0 ? n : 1) * sizeof *F->funtab);
+	F->funcap = n;
+	while (F->funlen < n) {
+		if (!(F->funtab[F->funlen] = jsS_getref(J, r, S_FUNCTION)))
+			jsS_error(J);
+		++F->funlen;
+	}
+}
+
+static void jsS_getobject(js_State *J, jsS_Reader *r, js_Object *obj)
+{
+	js_Property *ref;
+	js_Iterator **tail;
+	const char *name, *error;
+	int type, extensible, atts, n, opts;
+
+	type = jsS_getint(J, r);
+	extensible = jsS_getint(J, r);
+	obj->prototype = jsS_getref(J, r, S_OBJECT);
+	n = jsS_getint(J, r);
+	while (n-- > 0) {
+		name = jsS_getstring(J, r);
+		if (!name)
+			jsS_error(J);
+		ref = jp_setproperty(J, obj, name);
+		atts = jsS_getint(J, r);
+		if (atts & JS_ACCESSOR) {
+			ref->u.acc.getter = jsS_getref(J, r, S_OBJECT);
+			ref->u.acc.setter = jsS_getref(J, r, S_OBJECT);
+		} else {
+			jsS_getvalue(J, r, &ref->u.value);
+		}
+		ref->atts = atts;
+	}
+
+	/* set the class last, so a failed restore never frees half a regexp or iterator */
+	switch (type) {
+	case JS_COBJECT:
+	case JS_CERROR:
+	case JS_CMATH:
+	case JS_CJSON:
+		break;
+	case JS_CARRAY:
+		obj->u.a.length = jsS_getint(J, r);
+		break;
+	case JS_CFUNCTION:
+	case JS_CSCRIPT:
+		obj->u.f.function = jsS_getref(J, r, S_FUNCTION);
+		obj->u.f.scope = jsS_getref(J, r, S_ENV);
+		if (!obj->u.f.function)
+			jsS_error(J);
+		break;
+	case JS_CCFUNCTION:
+		obj->u.c.name = jsS_getintern(J, r);
+		jsS_getmem(J, r, &obj->u.c.function, sizeof obj->u.c.function);
+		jsS_getmem(J, r, &obj->u.c.constructor, sizeof obj->u.c.constructor);
+		obj->u.c.length = jsS_getint(J, r);
+		break;
+	case JS_CBOOLEAN:
+		obj->u.boolean = jsS_getint(J, r);
+		break;
+	case JS_CNUMBER:
+	case JS_CDATE:
+		obj->u.number = jsS_getnumber(J, r);
+		break;
+	case JS_CSTRING:
+		obj->u.s.string = jsS_getintern(J, r);
+		obj->u.s.length = jsS_getint(J, r);
+		break;
+	case JS_CREGEXP:
+		name = jsS_getstring(J, r);
+		if (!name)
+			jsS_error(J);
+		obj->u.r.flags = jsS_getint(J, r);
+		obj->u.r.last = jsS_getint(J, r);
+		opts = 0;
+		if (obj->u.r.flags & JS_REGEXP_I) opts |= REG_ICASE;
+		if (obj->u.r.flags & JS_REGEXP_M) opts |= REG_NEWLINE;
+		obj->u.r.source = js_strdup(J, name);
+		obj->u.r.prog = js_regcompx(js_countalloc, J, name, opts, &error);
+		if (!obj->u.r.prog) {
+			js_free(J, obj->u.r.source);
+			jsS_error(J);
+		}
+		break;
+	case JS_CITERATOR:
+		obj->u.iter.target = jsS_getref(J, r, S_OBJECT);
+		if (!obj->u.iter.target)
+			jsS_error(J);
+		n = jsS_getint(J, r);
+		if (n < 0 || n > r->end - r->p)
+			jsS_error(J);
+		/* build the list as a separate iterator until it is complete */
+		obj->type = JS_CITERATOR;
+		tail = &obj->u.iter.head;
+		while (n-- > 0) {
+			js_Iterator *node = js_poolalloc(J, sizeof *node);
+			node->name = NULL;
+			node->next = NULL;
+			*tail = node;
+			tail = &node->next;
+			node->name = jsS_getintern(J, r);
+			if (!node->name)
+				jsS_error(J);
+		}
+		break;
+	case JS_CUSERDATA:
+		obj->u.user.tag = jsS_getintern(J, r);
+		jsS_getmem(J, r, &obj->u.user.data, sizeof obj->u.user.data);
+		jsS_getmem(J, r, &obj->u.user.has, sizeof obj->u.user.has);
+		jsS_getmem(J, r, &obj->u.user.put, sizeof obj->u.user.put);
+		jsS_getmem(J, r, &obj->u.user.delete, sizeof obj->u.user.delete);
+		if (!obj->u.user.tag)
+			jsS_error(J);
+		break;
+	default:
+		jsS_error(J);
+	}
+
+	obj->type = type;
+	obj->extensible = extensible;
+}
+
+static void jsS_read(js_State *J, jsS_Reader *r)
+{
+	js_Object **protos = &J->Object_prototype;
+	const void *cookie;
+	const char *s;
+	js_Function *F;
+	js_Env *E;
+	int i, k, n, count[S_KINDS];
+
+	if (r->end - r->p < 4 || memcmp(r->p, JS_SNAPMAGIC, 4))
+		jsS_error(J);
+	r->p += 4;
+	if (jsS_getint(J, r) != JS_SNAPVERSION)
+		jsS_error(J);
+	jsS_getmem(J, r, &cookie, sizeof cookie);
+	if (cookie != &jsS_cookie)
+		jsS_error(J);
+
+	/* the counts all come before the strings */
+	for (k = 0; k < S_KINDS; ++k) {
+		count[k] = jsS_getint(J, r);
+		if (count[k] < 0 || count[k] > r->end - r->p)
+			jsS_error(J);
+	}
+
+	/* allocate every node first, so references can be resolved as they are read */
+	for (k = 0; k < S_KINDS; ++k) {
+		r->node[k] = js_malloc(J, (count[k] > 0 ? count[k] : 1) * sizeof *r->node[k]);
+		r->n[k] = 0;
+		while (r->n[k] < count[k]) {
+			switch (k) {
+			case S_STRING:
+				s = jsS_getstring(J, r);
+				if (!s)
+					jsS_error(J);
+				r->node[k][r->n[k]] = jv_memstring(J, s, strlen(s));
+				break;
+			case S_FUNCTION:
+				F = js_malloc(J, sizeof *F);
+				memset(F, 0, sizeof *F);
+				F->gcmark = JS_GCNEWMARK(J);
+				F->gcnext = J->gcfun;
+				J->gcfun = F;
+				r->node[k][r->n[k]] = F;
+				break;
+			case S_ENV:
+				r->node[k][r->n[k]] = jsR_newenvironment(J, NULL, NULL);
+				break;
+			case S_OBJECT:
+				r->node[k][r->n[k]] = js_newobject(J, JS_COBJECT, NULL);
+				break;
+			}
+			++r->n[k];
+		}
+	}
+
+	for (i = 0; i < r->n[S_FUNCTION]; ++i)
+		jsS_getfunction(J, r, r->node[S_FUNCTION][i]);
+	for (i = 0; i < r->n[S_ENV]; ++i) {
+		E = r->node[S_ENV][i];
+		E->variables = jsS_getref(J, r, S_OBJECT);
+		E->outer = jsS_getref(J, r, S_ENV);
+		if (!E->variables)
+			jsS_error(J);
+	}
+	for (i = 0; i < r->n[S_OBJECT]; ++i)
+		jsS_getobject(J, r, r->node[S_OBJECT][i]);
+
+	for (i = 0; &protos[i] <= &J->URIError_prototype; ++i)
+		protos[i] = jsS_getref(J, r, S_OBJECT);
+	J->R = jsS_getref(J, r, S_OBJECT);
+	J->G = jsS_getref(J, r, S_OBJECT);
+	J->E = jsS_getref(J, r, S_ENV);
+	J->GE = jsS_getref(J, r, S_ENV);
+	if (!J->R || !J->G || !J->E || !J->GE)
+		jsS_error(J);
+	J->nextref = jsS_getint(J, r);
+	J->lazy = jsS_getint(J, r);
+	J->strict = J->default_strict = jsS_getint(J, r);
+	J->lazycompile = jsS_getint(J, r);
+	n = jsS_getint(J, r);
+	if (n < 0 || n > JS_STACKSIZE)
+		jsS_error(J);
+	for (i = 0; i < n; ++i)
+		jsS_getvalue(J, r, &J->stack[i]);
+	J->top = n;
+
+	jsS_getmem(J, r, &J->report, sizeof J->report);
+	jsS_getmem(J, r, &J->panic, sizeof J->panic);
+	jsS_getmem(J, r, &J->finalize, sizeof J->finalize);
+	J->gcpause = jsS_getint(J, r);
+	J->gcminheap = jsS_getint(J, r);
+	J->gcnursery = jsS_getint(J, r);
+	J->gcincremental = jsS_getint(J, r);
+	J->gcstepsize = jsS_getint(J, r);
+	J->gcstepmul = jsS_getint(J, r);
+	J->gcgenerational = jsS_getint(J, r);
+	jsS_getmem(J, r, &J->memlimit, sizeof J->memlimit);
+	J->codemax = jsS_getint(J, r);
+	J->gcmajor = J->gclimit = (size_t)J->gcminheap * 1024;
+	if (J->gcgenerational)
+		J->gcmajor = 0; /* nothing is old yet; start with a major collection */
+
+	if (r->p != r->end)
+		jsS_error(J);
+}
+
+void jsS_restore(js_State *J, const void *data, int size)
+{
+	jsS_Reader r;
+	int k;
+
+	memset(&r, 0, sizeof r);
+	r.p = data;
+	r.end = r.p + size;
+
+	if (js_try(J)) {
+		for (k = 0; k < S_KINDS; ++k)
+			js_free(J, r.node[k]);
+		js_throw(J);
+	}
+	jsS_read(J, &r);
+	js_endtry(J);
+
+	for (k = 0; k < S_KINDS; ++k)
+		js_free(J, r.node[k]);
+}
@@ -1,4 +1,5 @@
 #include "jsi.h"
+#include "jslex.h"
 #include "jsparse.h"
 #include "jscompile.h"
 #include "jsvalue.h"
@@ -60,7 +61,6 @@ const char *js_trystring(js_State *J, int idx, const char *error)
 
 static void js_loadstringx(js_State *J, const char *filename, const char *source, int iseval)
 {
-	js_Ast *P;
 	js_Function *F;
 
 	if (js_try(J)) {
@@ -68,9 +68,7 @@ static void js_loadstringx(js_State *J, const char *filename, const char *source
 		js_throw(J);
 	}
 
-	P = jsP_parse(J, filename, source);
-	F = jsC_compile(J, P);
-	jsP_freeparse(J);
+	F = jsQ_compile(J, filename, NULL, source, 0);
 	js_new_script(J, F, iseval ? (J->strict ? J->E : NULL) : J->GE);
 
 	js_endtry(J);
@@ -86,6 +84,64 @@ void js_loadstring(js_State *J, const char *filename, const char *source)
 	js_loadstringx(J, filename, source, 0);
 }
 
+/*
+	A module is a script compiled in a state of its own, whose functions
+	and strings are then frozen. The compiling state is freed; the module
+	keeps the frozen block, and so does each state that loads it.
+*/
+
+js_Module *js_compilemodule(js_State *J, const char *filename, const char *source)
+{
+	char message[256];
+	js_Function *F;
+	js_Module *M;
+	js_State *T;
+
+	T = js_newstate(J->alloc, J->actx, J->default_strict ? JS_STRICT : 0);
+	if (!T)
+		js_error(J, "out of memory");
+
+	if (js_try(T)) {
+		int syntax = js_is_object(T, -1);
+		if (syntax)
+			js_get_prop(T, -1, "message");
+		snprintf(message, sizeof message, "%s", js_trystring(T, -1, "cannot compile module"));
+		js_freestate(T);
+		if (syntax)
+			js_error_syntax(J, "%s", message);
+		js_error(J, "%s", message);
+	}
+	js_loadstring(T, filename, source);
+	F = js_toobject(T, -1)->u.f.function;
+	jsG_freeze(T);
+	M = T->alloc(T->actx, NULL, sizeof *M);
+	if (!M)
+		js_error(T, "out of memory");
+	M->shared = T->shared;
+	M->main = F;
+	jsG_retain(M->shared);
+	js_endtry(T);
+
+	js_freestate(T);
+	return M;
+}
+
+void js_freemodule(js_Module *M)
+{
+	js_Shared *S;
+	if (M) {
+		S = M->shared;
+		S->alloc(S->actx, M, 0);
+		jsG_release(S);
+	}
+}
+
+void js_loadmodule(js_State *J, js_Module *M)
+{
+	jsG_holdmodule(J, M->shared);
+	js_new_script(J, M->main, J->GE);
+}
+
 void js_loadfile(js_State *J, const char *filename)
 {
 	FILE *f;
@@ -134,13 +190,40 @@ void js_loadfile(js_State *J, const char *filename)
 		js_throw(J);
 	}
 
-	js_loadstring(J, filename, s);
+	if (jsK_iscode(s, n))
+		js_loadcode(J, filename, s, n);
+	else
+		js_loadstring(J, filename, s);
 
 	js_free(J, s);
 	fclose(f);
 	js_endtry(J);
 }
 
+/*
+	Compile a script while it is read, for scripts too big to hold in
+	memory whole. Each statement is compiled as soon as it is parsed,
+	and its syntax tree freed.
+*/
+void js_loadstream(js_State *J, const char *filename, js_Read read, void *data)
+{
+	js_Function *F;
+
+	if (js_try(J)) {
+		jsP_freeparse(J);
+		jsY_freestream(J);
+		js_throw(J);
+	}
+
+	jsP_initstream(J, filename, read, data);
+	F = jsC_compilestream(J);
+	jsP_freeparse(J);
+	jsY_freestream(J);
+	js_new_script(J, F, J->GE);
+
+	js_endtry(J);
+}
+
 int js_dostring(js_State *J, const char *source)
 {
 	if (js_try(J)) {
@@ -199,7 +282,8 @@ void *js_getcontext(js_State *J)
 	return J->uctx;
 }
 
-js_State *js_newstate(js_Alloc alloc, void *actx, int flags)
+/* a state with no heap yet, for js_newstate, js_restorestate and js_clonestate to fill */
+js_State *js_newstatex(js_Alloc alloc, void *actx)
 {
 	js_State *J;
 
@@ -216,9 +300,6 @@ js_State *js_newstate(js_Alloc alloc, void *actx, int flags)
 	J->actx  = actx;
 	J->alloc = alloc;
 
-	if (flags & JS_STRICT)
-		J->strict = J->default_strict = 1;
-
 	J->trace[0].name = "-top-";
 	J->trace[0].file = "native";
 	J->trace[0].line = 0;
@@ -228,13 +309,34 @@ js_State *js_newstate(js_Alloc alloc, void *actx, int flags)
 
 	J->stack = alloc(actx, NULL, JS_STACKSIZE * sizeof *J->stack);
 	if (!J->stack) {
-		alloc(actx, NULL, 0);
+		alloc(actx, J, 0);
 		return NULL;
 	}
 
 	J->gcmark = 1;
+	J->gcpause = JS_GCGROWTH;
+	J->gcminheap = JS_GCHEAPMIN;
+	J->gcnursery = JS_GCYOUNG;
+	J->gcstepsize = JS_GCSTEP;
+	J->gcstepmul = JS_GCWORK;
+	J->gcmajor = J->gclimit = (size_t)J->gcminheap * 1024;
+	J->codemax = JS_CODECACHE;
 	J->nextref = 0;
 
+	return J;
+}
+
+js_State *js_newstate(js_Alloc alloc, void *actx, int flags)
+{
+	js_State *J = js_newstatex(alloc, actx);
+	if (!J)
+		return NULL;
+
+	if (flags & JS_STRICT)
+		J->strict = J->default_strict = 1;
+	if (flags & JS_LAZYCOMPILE)
+		J->lazycompile = 1;
+
 	J->R = js_newobject(J, JS_COBJECT, NULL);
 	J->G = js_newobject(J, JS_COBJECT, NULL);
 	J->E = jsR_newenvironment(J, J->G, NULL);
@@ -244,3 +346,19 @@ js_State *js_newstate(js_Alloc alloc, void *actx, int flags)
 
 	return J;
 }
+
+js_State *js_restorestate(const void *data, int size, js_Alloc alloc, void *actx)
+{
+	js_State *J = js_newstatex(alloc, actx);
+	if (!J)
+		return NULL;
+
+	if (js_try(J)) {
+		js_freestate(J);
+		return NULL;
+	}
+	jsS_restore(J, data, size);
+	js_endtry(J);
+
+	return J;
+}
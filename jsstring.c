@@ -331,7 +331,7 @@ static void Sp_match(js_State *J)
 
 	re = js_toregexp(J, -1);
 	if (!(re->flags & JS_REGEXP_G)) {
-		js_RegExp_prototype_exec(J, re, text);
+		js_RegExp_prototype_exec(J, re, 0);
 		return;
 	}
 
@@ -381,12 +381,61 @@ static void Sp_search(js_State *J)
 		js_push_number(J, -1);
 }
 
+/* Expand a replacement template for the match s..s+n within source */
+static void expandreplace(js_State *J, js_Buffer **sb, const char *r,
+	const char *source, const char *s, int n, Resub *m)
+{
+	const char *t;
+	int x;
+
+	while (*r) {
+		if (*r != '$') {
+			t = r;
+			while (*r && *r != '$')
+				++r;
+			js_putm(J, sb, t, r);
+			continue;
+		}
+		t = r++;
+		switch (*r) {
+		case 0: js_putc(J, sb, '$'); continue;
+		case '$':  js_putc(J, sb, '$'); break;
+		case '&':  js_putm(J, sb, s, s + n); break;
+		case '`':  js_putm(J, sb, source, s); break;
+		case '\'': js_puts(J, sb, s + n); break;
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			x = *r - '0';
+			if (m && r[1] >= '0' && r[1] <= '9' && x * 10 + r[1] - '0' < m->nsub)
+				x = x * 10 + *(++r) - '0';
+			if (m && x > 0 && x < m->nsub)
+				js_putm(J, sb, m->sub[x].sp, m->sub[x].ep);
+			else
+				js_putm(J, sb, t, r + 1);
+			break;
+		default:
+			js_putm(J, sb, t, r + 1);
+			break;
+		}
+		++r;
+	}
+}
+
+static void pushreplace(js_State *J, js_Buffer *sb)
+{
+	if (sb)
+		js_push_lstr(J, sb->s, sb->n);
+	else
+		js_push_literal(J, "");
+}
+
 static void Sp_replace_regexp(js_State *J)
 {
 	js_Regexp *re;
-	const char *source, *s, *r;
+	const char *source, *p, *q, *s, *r;
 	js_Buffer *sb = NULL;
-	int n, x;
+	int idx, n, x;
+	Rune rune;
 	Resub m;
 
 	source = checkstring(J, 0);
@@ -399,92 +448,65 @@ static void Sp_replace_regexp(js_State *J)
 
 	re->last = 0;
 
+	if (js_try(J)) {
+		js_free(J, sb);
+		js_throw(J);
+	}
+
+	p = source; /* end of the previous match; copied up to the next one */
+	q = source; /* idx is the character index of q */
+	idx = 0;
+
 loop:
 	s = m.sub[0].sp;
 	n = m.sub[0].ep - m.sub[0].sp;
 
+	js_putm(J, &sb, p, s);
+
 	if (js_is_callable(J, 2)) {
+		idx += js_utfptrtoidx(q, s);
+		q = s;
 		js_copy(J, 2);
 		js_push_undef(J);
-		for (x = 0; m.sub[x].sp; ++x) /* arg 0..x: substring and subexps that matched */
-			js_push_lstr(J, m.sub[x].sp, m.sub[x].ep - m.sub[x].sp);
-		js_push_number(J, s - source); /* arg x+2: offset within search string */
+		for (x = 0; x < m.nsub; ++x) { /* arg 0..x: substring and subexps */
+			if (m.sub[x].sp)
+				js_push_lstr(J, m.sub[x].sp, m.sub[x].ep - m.sub[x].sp);
+			else
+				js_push_undef(J);
+		}
+		js_push_number(J, idx); /* arg x+2: offset within search string */
 		js_copy(J, 0); /* arg x+3: search string */
 		js_call(J, 2 + x);
 		r = js_tostring(J, -1);
-		js_putm(J, &sb, source, s);
 		js_puts(J, &sb, r);
 		js_pop(J, 1);
 	} else {
-		r = js_tostring(J, 2);
-		js_putm(J, &sb, source, s);
-		while (*r) {
-			if (*r == '$') {
-				switch (*(++r)) {
-				case 0: --r; /* end of string; back up and fall through */
-				case '$':  js_putc(J, &sb, '$'); break;
-				case '`':  js_putm(J, &sb, source, s); break;
-				case '\'': js_puts(J, &sb, s + n); break;
-				case '&':
-					js_putm(J, &sb, s, s + n);
-					break;
-				case '0': case '1': case '2': case '3': case '4':
-				case '5': case '6': case '7': case '8': case '9':
-					x = *r - '0';
-					if (r[1] >= '0' && r[1] <= '9')
-						x = x * 10 + *(++r) - '0';
-					if (x > 0 && x < m.nsub) {
-						js_putm(J, &sb, m.sub[x].sp, m.sub[x].ep);
-					} else {
-						js_putc(J, &sb, '$');
-						if (x > 10) {
-							js_putc(J, &sb, '0' + x / 10);
-							js_putc(J, &sb, '0' + x % 10);
-						} else {
-							js_putc(J, &sb, '0' + x);
-						}
-					}
-					break;
-				default:
-					js_putc(J, &sb, '$');
-					js_putc(J, &sb, *r);
-					break;
-				}
-				++r;
-			} else {
-				js_putc(J, &sb, *r++);
-			}
-		}
+		expandreplace(J, &sb, js_tostring(J, 2), source, s, n, &m);
 	}
 
+	p = s + n;
+
 	if (re->flags & JS_REGEXP_G) {
-		source = m.sub[0].ep;
+		r = p;
 		if (n == 0) {
-			if (*source)
-				js_putc(J, &sb, *source++);
-			else
+			if (!*r)
 				goto end;
+			r += chartorune(&rune, r);
 		}
-		if (!js_regexec(re->prog, source, &m, REG_NOTBOL))
+		if (!js_regexec(re->prog, r, &m, REG_NOTBOL))
 			goto loop;
 	}
 
 end:
-	js_puts(J, &sb, s + n);
-	js_putc(J, &sb, 0);
-
-	if (js_try(J)) {
-		js_free(J, sb);
-		js_throw(J);
-	}
-	js_push_string(J, sb ? sb->s : "");
+	js_puts(J, &sb, p);
+	pushreplace(J, sb);
 	js_endtry(J);
 	js_free(J, sb);
 }
 
 static void Sp_replace_string(js_State *J)
 {
-	const char *source, *needle, *s, *r;
+	const char *source, *needle, *s;
 	js_Buffer *sb = NULL;
 	int n;
 
@@ -498,46 +520,28 @@ static void Sp_replace_string(js_State *J)
 	}
 	n = strlen(needle);
 
+	if (js_try(J)) {
+		js_free(J, sb);
+		js_throw(J);
+	}
+
 	if (js_is_callable(J, 2)) {
 		js_copy(J, 2);
 		js_push_undef(J);
 		js_push_lstr(J, s, n); /* arg 1: substring that matched */
-		js_push_number(J, s - source); /* arg 2: offset within search string */
+		js_push_number(J, js_utfptrtoidx(source, s)); /* arg 2: offset within search string */
 		js_copy(J, 0); /* arg 3: search string */
 		js_call(J, 3);
-		r = js_tostring(J, -1);
 		js_putm(J, &sb, source, s);
-		js_puts(J, &sb, r);
-		js_puts(J, &sb, s + n);
-		js_putc(J, &sb, 0);
+		js_puts(J, &sb, js_tostring(J, -1));
 		js_pop(J, 1);
 	} else {
-		r = js_tostring(J, 2);
 		js_putm(J, &sb, source, s);
-		while (*r) {
-			if (*r == '$') {
-				switch (*(++r)) {
-				case 0: --r; /* end of string; back up and fall through */
-				case '$':  js_putc(J, &sb, '$'); break;
-				case '&':  js_putm(J, &sb, s, s + n); break;
-				case '`':  js_putm(J, &sb, source, s); break;
-				case '\'': js_puts(J, &sb, s + n); break;
-				default:   js_putc(J, &sb, '$'); js_putc(J, &sb, *r); break;
-				}
-				++r;
-			} else {
-				js_putc(J, &sb, *r++);
-			}
-		}
-		js_puts(J, &sb, s + n);
-		js_putc(J, &sb, 0);
+		expandreplace(J, &sb, js_tostring(J, 2), source, s, n, NULL);
 	}
+	js_puts(J, &sb, s + n);
 
-	if (js_try(J)) {
-		js_free(J, sb);
-		js_throw(J);
-	}
-	js_push_string(J, sb ? sb->s : "");
+	pushreplace(J, sb);
 	js_endtry(J);
 	js_free(J, sb);
 }
@@ -550,12 +554,30 @@ static void Sp_replace(js_State *J)
 		Sp_replace_string(J);
 }
 
+/* Append a substring to the fresh array built by split() */
+static void splitpush(js_State *J, js_Object *arr, const char *s, int n)
+{
+	char buf[32];
+	js_Property *ref;
+
+	if (s)
+		js_push_lstr(J, s, n);
+	else
+		js_push_undef(J);
+	ref = jp_setproperty(J, arr, js_itoa(buf, arr->u.a.length++));
+	ref->u.value = *js_tovalue(J, -1);
+	jsG_barrier(J, arr, &ref->u.value);
+	js_pop(J, 1);
+}
+
 static void Sp_split_regexp(js_State *J)
 {
 	js_Regexp *re;
+	js_Object *arr;
 	const char *text;
-	int limit, len, k;
-	const char *p, *a, *b, *c, *e;
+	int limit, k;
+	const char *p, *q, *b, *c, *e;
+	Rune rune;
 	Resub m;
 
 	text  = checkstring(J, 0);
@@ -563,50 +585,46 @@ static void Sp_split_regexp(js_State *J)
 	limit = js_is_def(J, 2) ? js_tointeger(J, 2) : 1 << 30;
 
 	js_new_array(J);
-	len = 0;
+	arr = js_toobject(J, -1);
 
 	e = text + strlen(text);
 
 	/* splitting the empty string */
 	if (e == text) {
-		if (js_regexec(re->prog, text, &m, 0)) {
-			if (len == limit) return;
-			js_push_literal(J, "");
-			js_set_index(J, -2, 0);
-		}
+		if (limit > 0 && js_regexec(re->prog, text, &m, 0))
+			splitpush(J, arr, text, 0);
 		return;
 	}
 
-	p = a = text;
-	while (a < e) {
-		if (js_regexec(re->prog, a, &m, a > text ? REG_NOTBOL : 0))
+	p = q = text;
+	while (q < e) {
+		if (js_regexec(re->prog, q, &m, q > text ? REG_NOTBOL : 0))
 			break; /* no match */
 
 		b = m.sub[0].sp;
 		c = m.sub[0].ep;
 
-		/* empty string at end of last match */
-		if (b == p) {
-			++a;
+		/* empty match at the end of the last part; retry one character on */
+		if (c == p) {
+			q = b + chartorune(&rune, b);
 			continue;
 		}
+		if (b >= e)
+			break;
 
-		if (len == limit) return;
-		js_push_lstr(J, p, b - p);
-		js_set_index(J, -2, len++);
+		if (arr->u.a.length == limit) return;
+		splitpush(J, arr, p, b - p);
 
 		for (k = 1; k < m.nsub; ++k) {
-			if (len == limit) return;
-			js_push_lstr(J, m.sub[k].sp, m.sub[k].ep - m.sub[k].sp);
-			js_set_index(J, -2, len++);
+			if (arr->u.a.length == limit) return;
+			splitpush(J, arr, m.sub[k].sp, m.sub[k].ep - m.sub[k].sp);
 		}
 
-		a = p = c;
+		p = q = c;
 	}
 
-	if (len == limit) return;
-	js_push_string(J, p);
-	js_set_index(J, -2, len);
+	if (arr->u.a.length == limit) return;
+	splitpush(J, arr, p, e - p);
 }
 
 static void Sp_split_string(js_State *J)
@@ -614,35 +632,34 @@ static void Sp_split_string(js_State *J)
 	const char *str = checkstring(J, 0);
 	const char *sep = js_tostring(J, 1);
 	int limit = js_is_def(J, 2) ? js_tointeger(J, 2) : 1 << 30;
-	int i, n;
+	js_Object *arr;
+	const char *s;
+	int n;
 
 	js_new_array(J);
+	arr = js_toobject(J, -1);
 
 	n = strlen(sep);
 
 	/* empty string */
 	if (n == 0) {
 		Rune rune;
-		for (i = 0; *str && i < limit; ++i) {
+		while (*str && arr->u.a.length < limit) {
 			n = chartorune(&rune, str);
-			js_push_lstr(J, str, n);
-			js_set_index(J, -2, i);
+			splitpush(J, arr, str, n);
 			str += n;
 		}
 		return;
 	}
 
-	for (i = 0; str && i < limit; ++i) {
-		const char *s = strstr(str, sep);
-		if (s) {
-			js_push_lstr(J, str, s-str);
-			js_set_index(J, -2, i);
-			str = s + n;
-		} else {
-			js_push_string(J, str);
-			js_set_index(J, -2, i);
-			str = NULL;
+	while (arr->u.a.length < limit) {
+		s = strstr(str, sep);
+		if (!s) {
+			splitpush(J, arr, str, strlen(str));
+			break;
 		}
+		splitpush(J, arr, str, s - str);
+		str = s + n;
 	}
 }
 
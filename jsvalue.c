@@ -35,13 +35,20 @@ int js_ntoi32(double n)
 
 js_String *jv_memstring(js_State *J, const char *s, int n)
 {
-	js_String *v = js_malloc(J, soffsetof(js_String, p) + n + 1);
+	int size = soffsetof(js_String, p) + n + 1;
+	js_String *v;
+	if (size <= JS_POOLMAX) {
+		v = js_poolalloc(J, size);
+		v->cells = (size + JS_POOLQUANTUM - 1) / JS_POOLQUANTUM;
+	} else {
+		v = js_malloc(J, size);
+		v->cells = 0;
+	}
 	memcpy(v->p, s, n);
 	v->p[n] = 0;
-	v->gcmark = 0;
+	v->gcmark = JS_GCNEWMARK(J);
 	v->gcnext = J->gcstr;
 	J->gcstr = v;
-	++J->gccounter;
 	return v;
 }
 
@@ -3,6 +3,7 @@
 
 typedef struct js_Property js_Property;
 typedef struct js_Iterator js_Iterator;
+typedef struct js_Match js_Match;
 
 /* Hint to ToPrimitive() */
 enum {
@@ -65,6 +66,7 @@ struct js_String
 {
 	js_String *gcnext;
 	char gcmark;
+	unsigned char cells; /* pool quanta allocated, or 0 if from js_malloc */
 	char p[1];
 };
 
@@ -73,7 +75,10 @@ struct js_Regexp
 	void *prog;
 	char *source;
 	unsigned short flags;
-	unsigned short last;
+	int last; /* lastIndex, in characters */
+	const char *text; /* string of the previous global match */
+	int textsweep; /* J->gcsweeps when 'text' was cached */
+	int byte; /* byte offset of 'last' within 'text' */
 };
 
 struct js_Object
@@ -92,6 +97,7 @@ struct js_Object
 		} s;
 		struct {
 			int length;
+			js_Match *match; /* captures not yet turned into properties */
 		} a;
 		struct {
 			js_Function *function;
@@ -121,15 +127,19 @@ struct js_Object
 	int gcmark;
 };
 
+/* atts bit for properties that hold a getter and setter instead of a value */
+#define JS_ACCESSOR 0x80
+
 struct js_Property
 {
 	const char *name;
 	js_Property *left, *right;
-	int level;
-	int atts;
-	js_Value value;
-	js_Object *getter;
-	js_Object *setter;
+	unsigned short level;
+	unsigned short atts;
+	union {
+		js_Value value;
+		struct { js_Object *getter, *setter; } acc;
+	} u;
 };
 
 struct js_Iterator
@@ -138,6 +148,21 @@ struct js_Iterator
 	js_Iterator *next;
 };
 
+/*
+	The array returned by RegExp.prototype.exec keeps the match as byte
+	offsets into the input string. Its 'index', 'input' and capture
+	properties are created the first time anything looks past 'index',
+	'input' and 'length'.
+*/
+
+struct js_Match
+{
+	js_Value input;
+	int index;
+	int nsub;
+	int sub[1]; /* start and end byte offset of each capture, -1 if unmatched */
+};
+
 
 
 void       js_toprimitive(js_State *J, int idx, int hint);
@@ -167,10 +192,27 @@ js_String   *jv_memstring(js_State *J, const char *s, int n);
 js_Object   *jp_newobject(js_State *J, enum js_Class type, js_Object *prototype);
 #define js_newobject jp_newobject
 
+js_Property *jp_getownproperty(js_State *J, js_Object *obj, const char *name);
+js_Property *jp_getpropertyx(js_State *J, js_Object *obj, const char *name, int *own);
+js_Property *jp_getproperty(js_State *J, js_Object *obj, const char *name);
+js_Property *jp_setproperty(js_State *J, js_Object *obj, const char *name);
+void         jp_delproperty(js_State *J, js_Object *obj, const char *name);
+
+js_Object  *jp_newmatch(js_State *J, js_Value *input, int index, struct Resub *m);
+void        jp_materialize(js_State *J, js_Object *obj);
+
 js_Object  *jp_newiterator(js_State *J, js_Object *obj, int own);
 const char *jp_nextiterator(js_State *J, js_Object *iter);
 void        jp_resizearray(js_State *J, js_Object *obj, int newlen);
 
+/* jsgc.c */
+void jsG_barrier(js_State *J, js_Object *obj, js_Value *v);
+void jsG_barrierobject(js_State *J, js_Object *obj, js_Object *v);
+void jsG_barrierfunction(js_State *J, js_Function *fun);
+int jsG_objectsize(js_Object *obj);
+int jsG_functionsize(js_Function *fun);
+int jsG_stringsize(js_String *str);
+
 /* jsdump.c */
 void js_dumpobject(js_State *J, js_Object *obj);
 void js_dumpvalue(js_State *J, js_Value v);
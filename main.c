@@ -146,6 +146,29 @@ static int eval_print(js_State *J, const char *source)
 	return 0;
 }
 
+/* compile a script to a precompiled file next to it: foo.js becomes foo.jsc */
+static int compile_file(js_State *J, const char *filename)
+{
+	char output[1024];
+	int n = strlen(filename);
+
+	if (n > 3 && !strcmp(filename + n - 3, ".js"))
+		snprintf(output, sizeof output, "%sc", filename);
+	else
+		snprintf(output, sizeof output, "%s.jsc", filename);
+
+	if (js_try(J)) {
+		fprintf(stderr, "%s\n", js_trystring(J, -1, "Error"));
+		js_pop(J, 1);
+		return 1;
+	}
+	js_loadfile(J, filename);
+	js_savecode(J, -1, output);
+	js_pop(J, 1);
+	js_endtry(J);
+	return 0;
+}
+
 static char *read_stdin(void)
 {
 	int n = 0;
@@ -209,7 +232,11 @@ main(int argc, char **argv)
 	js_dostring(J, require_js);
 	js_dostring(J, stacktrace_js);
 
-	if (argc > 1) {
+	if (argc > 1 && !strcmp(argv[1], "-c")) {
+		for (i = 2; i < argc; ++i)
+			if (compile_file(J, argv[i]))
+				status = 1;
+	} else if (argc > 1) {
 		for (i = 1; i < argc; ++i)
 			if (js_dofile(J, argv[i]))
 				status = 1;
@@ -2,6 +2,7 @@
 #define mujs_h
 
 #include <setjmp.h> /* required for setjmp in fz_try macro */
+#include <stddef.h> /* size_t in the statistics structs */
 
 #ifdef __cplusplus
 extern "C" {
@@ -47,7 +48,10 @@ typedef unsigned int   uint;
 typedef unsigned short ushort;
 typedef unsigned long  ulong;
 typedef struct js_State js_State;
+typedef struct js_Module js_Module;
 typedef struct js_Value js_Value;
+typedef struct js_GCStats js_GCStats;
+typedef struct js_MemStats js_MemStats;
 
 typedef void*(*js_Alloc)(void *memctx, void *ptr, int size);
 typedef void (*js_Panic)(js_State *J);
@@ -57,6 +61,8 @@ typedef int  (*js_HasProperty)(js_State *J, void *p, const char *name);
 typedef int  (*js_Put)(js_State *J, void *p, const char *name);
 typedef int  (*js_Delete)(js_State *J, void *p, const char *name);
 typedef void (*js_Report)(js_State *J, const char *message);
+typedef void (*js_Notify)(js_State *J);
+typedef int  (*js_Read)(void *data, char *buf, int size);
 
 /* Basic functions */
 js_State *js_newstate(js_Alloc alloc, void *actx, int flags);
@@ -66,6 +72,17 @@ void      js_setreport(js_State *J, js_Report report);
 js_Panic  js_atpanic(js_State *J, js_Panic panic);
 void      js_freestate(js_State *J);
 void      js_gc(js_State *J, int report);
+int       js_gcparam(js_State *J, int param, int value);
+int       js_gcfinalize(js_State *J, int n);
+js_Notify js_atfinalize(js_State *J, js_Notify notify);
+void      js_gcstats(js_State *J, js_GCStats *stats);
+void      js_memstats(js_State *J, js_MemStats *stats);
+void      js_dumpheap(js_State *J, const char *filename);
+size_t    js_setmemlimit(js_State *J, size_t limit);
+int       js_setcodecache(js_State *J, int count);
+void     *js_snapshot(js_State *J, int *size);
+js_State *js_restorestate(const void *data, int size, js_Alloc alloc, void *actx);
+js_State *js_clonestate(js_State *J);
 
 int js_dostring(js_State *J, const char *source);
 int js_dofile(js_State *J, const char *filename);
@@ -85,6 +102,50 @@ void js_endtry(js_State *J);
 /* State constructor flags */
 enum {
 	JS_STRICT = 1,
+	JS_LAZYCOMPILE = 2, /* compile inner functions when they are first called */
+};
+
+/* Garbage collector parameters for js_gcparam */
+enum {
+	JS_GCINCREMENTAL, /* 1 to spread collections over many small steps */
+	JS_GCSTEPSIZE, /* kilobytes allocated between incremental steps */
+	JS_GCSTEPMUL, /* work done per kilobyte, sets the pause length */
+	JS_GCGENERATIONAL, /* 1 to collect young objects separately */
+	JS_GCPAUSE, /* collect when the heap has grown to this percentage of its live size */
+	JS_GCMINHEAP, /* do not collect until the heap is this many kilobytes */
+	JS_GCNURSERY, /* kilobytes allocated between minor collections */
+};
+
+/* Collector statistics for js_gcstats, kept over the life of the state */
+#define JS_GCHISTOGRAM 16
+struct js_GCStats
+{
+	size_t allocated; /* bytes allocated */
+	size_t allocations; /* blocks allocated */
+	int collections; /* full collections finished */
+	int minors; /* minor collections finished */
+	int pauses; /* times the collector ran */
+	double pausetime; /* total seconds spent in the collector */
+	double pausemax; /* longest pause in seconds */
+	int histogram[JS_GCHISTOGRAM]; /* pauses under 2^i microseconds; the last bucket takes the rest */
+};
+
+/* Heap contents for js_memstats. Objects are counted by class, in the
+ * order Object, Array, Function, Script, CFunction, Error, Boolean,
+ * Number, String, RegExp, Date, Math, JSON, Iterator, Userdata.
+ */
+#define JS_MEMCLASSES 16
+struct js_MemStats
+{
+	size_t bytes; /* bytes in use */
+	size_t pages; /* bytes held in pages for small blocks */
+	int objects, classes[JS_MEMCLASSES]; size_t objbytes;
+	int properties; size_t propbytes;
+	int environments; size_t envbytes;
+	int functions; size_t funbytes;
+	int strings; size_t strbytes;
+	int interned; size_t internbytes;
+	int finalizers; /* dead userdata waiting for its finalizer */
 };
 
 /* RegExp flags */
@@ -119,7 +180,14 @@ JS_NORETURN void js_throw(js_State *J);
 
 void js_loadstring(js_State *J, const char *filename, const char *source);
 void js_loadfile(js_State *J, const char *filename);
+void js_loadstream(js_State *J, const char *filename, js_Read read, void *data);
 void js_loadeval(js_State *J, const char *filename, const char *source);
+void js_loadcode(js_State *J, const char *name, const char *data, int size);
+void js_loadimage(js_State *J, const char *name, const char *data, int size);
+js_Module *js_compilemodule(js_State *J, const char *filename, const char *source);
+void js_loadmodule(js_State *J, js_Module *M);
+void js_freemodule(js_Module *M);
+void js_savecode(js_State *J, int idx, const char *filename);
 
 void js_eval(js_State *J);
 void js_call(js_State *J, int n);
@@ -25,6 +25,7 @@ typedef struct Rethread Rethread;
 struct Reclass {
 	Rune *end;
 	Rune spans[64];
+	int canon; /* too big to fold: match against canon() of every member */
 };
 
 struct Reprog {
@@ -60,8 +61,11 @@ static void die(struct cstate *g, const char *message)
 
 static int canon(Rune c)
 {
-	Rune u = toupperrune(c);
-	if (c >= 128 && u < 128)
+	Rune u;
+	if (c < 128) /* fast path for ASCII */
+		return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+	u = toupperrune(c);
+	if (u < 128)
 		return c;
 	return u;
 }
@@ -187,6 +191,7 @@ static void newcclass(struct cstate *g)
 		die(g, "too many character classes");
 	g->yycc = g->prog->cclass + g->ncclass++;
 	g->yycc->end = g->yycc->spans;
+	g->yycc->canon = 0;
 }
 
 static void addrange(struct cstate *g, Rune a, Rune b)
@@ -199,6 +204,43 @@ static void addrange(struct cstate *g, Rune a, Rune b)
 	*g->yycc->end++ = b;
 }
 
+static int inspan(Reclass *cc, Rune a, Rune b)
+{
+	Rune *p;
+	for (p = cc->spans; p < cc->end; p += 2)
+		if (p[0] <= a && b <= p[1])
+			return 1;
+	return 0;
+}
+
+/* Add the canonical case of every member so matching only needs canon(c). */
+static void foldclass(struct cstate *g, Reclass *cc)
+{
+	Rune *p, *end = cc->end;
+	Rune lo, hi;
+	int c, delta;
+
+	for (p = cc->spans; p < end; p += 2) {
+		c = p[0];
+		while (c <= p[1] && touppernext(c, &lo, &hi, &delta) && lo <= p[1]) {
+			if (hi > p[1])
+				hi = p[1];
+			/* canon() leaves runes that would upper case into ASCII alone */
+			if (!(lo >= 128 && lo + delta < 128)) {
+				if (!inspan(cc, lo + delta, hi + delta)) {
+					if (cc->end + 2 == cc->spans + nelem(cc->spans)) {
+						cc->end = end;
+						cc->canon = 1;
+						return;
+					}
+					addrange(g, lo + delta, hi + delta);
+				}
+			}
+			c = hi + 1;
+		}
+	}
+}
+
 static void addranges_d(struct cstate *g)
 {
 	addrange(g, '0', '9');
@@ -470,12 +512,16 @@ static Renode *parseatom(struct cstate *g)
 	if (g->lookahead == L_CCLASS) {
 		atom = newnode(g, P_CCLASS);
 		atom->cc = g->yycc;
+		if (g->prog->flags & REG_ICASE)
+			foldclass(g, atom->cc);
 		next(g);
 		return atom;
 	}
 	if (g->lookahead == L_NCCLASS) {
 		atom = newnode(g, P_NCCLASS);
 		atom->cc = g->yycc;
+		if (g->prog->flags & REG_ICASE)
+			foldclass(g, atom->cc);
 		next(g);
 		return atom;
 	}
@@ -935,6 +981,8 @@ static int incclass(Reclass *cc, Rune c)
 static int incclasscanon(Reclass *cc, Rune c)
 {
 	Rune *p, r;
+	if (!cc->canon)
+		return incclass(cc, c);
 	for (p = cc->spans; p < cc->end; p += 2)
 		for (r = p[0]; r <= p[1]; ++r)
 			if (c == canon(r))
@@ -16,6 +16,7 @@ typedef unsigned short Rune;	/* 16 bits */
 #define tolowerrune	jsU_tolowerrune
 #define totitlerune	jsU_totitlerune
 #define toupperrune	jsU_toupperrune
+#define touppernext	jsU_touppernext
 
 enum
 {
@@ -38,5 +39,6 @@ int		isupperrune(Rune c);
 Rune		tolowerrune(Rune c);
 Rune		totitlerune(Rune c);
 Rune		toupperrune(Rune c);
+int		touppernext(Rune c, Rune *lo, Rune *hi, int *delta);
 
 #endif
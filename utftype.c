@@ -1065,6 +1065,43 @@ toupperrune(Rune c)
 	return c;
 }
 
+/*
+ * find the first run of runes at or after c that
+ * toupperrune changes: *lo..*hi, all shifted by *delta
+ */
+int
+touppernext(Rune c, Rune *lo, Rune *hi, int *delta)
+{
+	Rune *p, *q, *pend, *qend;
+
+	pend = __toupper2 + nelem(__toupper2);
+	p = bsearch(c, __toupper2, nelem(__toupper2)/3, 3);
+	if(!p)
+		p = __toupper2;
+	else if(c > p[1])
+		p += 3;
+
+	qend = __toupper1 + nelem(__toupper1);
+	q = bsearch(c, __toupper1, nelem(__toupper1)/2, 2);
+	if(!q)
+		q = __toupper1;
+	else if(c > q[0])
+		q += 2;
+
+	if(p < pend && (q >= qend || p[0] <= q[0] || c >= p[0])) {
+		*lo = c > p[0] ? c : p[0];
+		*hi = p[1];
+		*delta = p[2] - 500;
+		return 1;
+	}
+	if(q < qend) {
+		*lo = *hi = q[0];
+		*delta = q[1] - 500;
+		return 1;
+	}
+	return 0;
+}
+
 Rune
 totitlerune(Rune c)
 {